@@ -10,6 +10,8 @@ LOBSTER_PATH := ../../..
 LOCAL_C_INCLUDES := $(SDL_PATH)/include $(LOBSTER_PATH)/src $(LOCAL_PATH)/$(LOBSTER_PATH)/include
 
 LOCAL_SRC_FILES := $(SDL_PATH)/src/main/android/SDL_android_main.c \
+	$(LOBSTER_PATH)/src/buffer.cpp \
+	$(LOBSTER_PATH)/src/hashmap.cpp \
 	$(LOBSTER_PATH)/src/lobster.cpp \
 	$(LOBSTER_PATH)/src/audio.cpp \
 	$(LOBSTER_PATH)/src/builtins.cpp \
@@ -24,11 +26,18 @@ LOCAL_SRC_FILES := $(SDL_PATH)/src/main/android/SDL_android_main.c \
 	$(LOBSTER_PATH)/src/graphics.cpp \
 	$(LOBSTER_PATH)/src/lobsterreader.cpp \
 	$(LOBSTER_PATH)/src/meshgen.cpp \
+	$(LOBSTER_PATH)/src/parallel.cpp \
+	$(LOBSTER_PATH)/src/pathgrid.cpp \
 	$(LOBSTER_PATH)/src/platform.cpp \
+	$(LOBSTER_PATH)/src/pqueue.cpp \
+	$(LOBSTER_PATH)/src/pvector.cpp \
 	$(LOBSTER_PATH)/src/sdlaudiosfxr.cpp \
 	$(LOBSTER_PATH)/src/sdlsystem.cpp \
+	$(LOBSTER_PATH)/src/serialize.cpp \
 	$(LOBSTER_PATH)/src/simplex.cpp \
+	$(LOBSTER_PATH)/src/sort.cpp \
 	$(LOBSTER_PATH)/src/stdafx.cpp \
+	$(LOBSTER_PATH)/src/stringbuilder.cpp \
 	$(LOBSTER_PATH)/src/vmdata.cpp \
 	$(LOBSTER_PATH)/lib/stb_image.c
 
@@ -0,0 +1,257 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+using namespace lobster;
+
+static int FlatCount(LVector *v)
+{
+    int n = 0;
+    for (int i = 0; i < v->len; i++)
+    {
+        auto &e = v->at(i);
+        switch (e.type)
+        {
+            case V_INT:
+            case V_FLOAT:  n++; break;
+            case V_VECTOR: n += FlatCount(e.vval); break;
+            default: g_vm->BuiltinError(string("buffer: non-numeric element: ") + g_vm->ProperTypeName(e));
+        }
+    }
+    return n;
+}
+
+static void FlatFill(LBuffer *b, LVector *v, int &i)
+{
+    for (int j = 0; j < v->len; j++)
+    {
+        auto &e = v->at(j);
+        if (e.type == V_VECTOR) FlatFill(b, e.vval, i);
+        else b->set(i++, e);
+    }
+}
+
+static Value BufferFromVector(Value &v, int et)
+{
+    auto b = g_vm->NewBuffer(FlatCount(v.vval), et);
+    int i = 0;
+    FlatFill(b, v.vval, i);
+    v.DECRT();
+    return Value(b);
+}
+
+static Value NewBufferChecked(Value &len, int et)
+{
+    if (len.ival < 0) g_vm->BuiltinError("buffer: negative size");
+    return Value(g_vm->NewBuffer(len.ival, et));
+}
+
+static void CheckNumeric(const Value &x, const char *name)
+{
+    if (x.type != V_INT && x.type != V_FLOAT)
+        g_vm->BuiltinError(string(name) + ": argument must be a buffer, int or float, not: " +
+                           g_vm->ProperTypeName(x));
+}
+
+template<typename T> T ScalarAs(const Value &x) { return x.type == V_FLOAT ? (T)x.fval : (T)x.ival; }
+
+template<typename T> struct BufAdd { static const bool div = false; static T op(T a, T b) { return a + b; } };
+template<typename T> struct BufSub { static const bool div = false; static T op(T a, T b) { return a - b; } };
+template<typename T> struct BufMul { static const bool div = false; static T op(T a, T b) { return a * b; } };
+template<typename T> struct BufDiv { static const bool div = true;  static T op(T a, T b) { return a / b; } };
+
+template<typename T, typename OP> void BufferKernel(T *d, const T *s, T k, int len)
+{
+    if (OP::div)
+    {
+        if (s) { for (int i = 0; i < len; i++) if (!s[i]) g_vm->BuiltinError("division by zero"); }
+        else if (!k) g_vm->BuiltinError("division by zero");
+    }
+    // separate loops so the compiler can vectorize either form
+    if (s) for (int i = 0; i < len; i++) d[i] = OP::op(d[i], s[i]);
+    else   for (int i = 0; i < len; i++) d[i] = OP::op(d[i], k);
+}
+
+// applies the operation element-wise to b in place, with x either a buffer of the same kind and length, or a scalar
+template<template<typename> class OP> Value BufferOp(Value &b, Value &x, const char *name)
+{
+    auto buf = b.bval;
+    const void *src = nullptr;
+    if (x.type == V_BUFFER)
+    {
+        if (x.bval->elemtype != buf->elemtype || x.bval->len != buf->len)
+            g_vm->BuiltinError(string(name) + ": buffers must be of the same kind and length");
+        src = x.bval->bdata();
+    }
+    else CheckNumeric(x, name);
+
+    switch (buf->elemtype)
+    {
+        case BE_FLOAT: BufferKernel<float, OP<float>>(buf->fdata(), (const float *)src, ScalarAs<float>(x), buf->len);
+                       break;
+        case BE_INT:   BufferKernel<int,   OP<int>  >(buf->idata(), (const int *)src, ScalarAs<int>(x), buf->len);
+                       break;
+        default:       BufferKernel<uchar, OP<uchar>>(buf->bdata(), (const uchar *)src, ScalarAs<uchar>(x), buf->len);
+                       break;
+    }
+    x.DEC();
+    return b;
+}
+
+template<typename T> void BufferRamp(T *d, int len, float start, float step)
+{
+    for (int i = 0; i < len; i++) d[i] = (T)(start + step * i);
+}
+
+void AddBuffer()
+{
+    STARTDECL(buffer_float) (Value &len) { return NewBufferChecked(len, BE_FLOAT); }
+    ENDDECL1(buffer_float, "len", "I", "B",
+        "creates a buffer of len 32-bit floats, all 0");
+
+    STARTDECL(buffer_int) (Value &len) { return NewBufferChecked(len, BE_INT); }
+    ENDDECL1(buffer_int, "len", "I", "B",
+        "creates a buffer of len 32-bit ints, all 0");
+
+    STARTDECL(buffer_byte) (Value &len) { return NewBufferChecked(len, BE_BYTE); }
+    ENDDECL1(buffer_byte, "len", "I", "B",
+        "creates a buffer of len bytes (unsigned 8-bit ints), all 0");
+
+    STARTDECL(buffer_of_floats) (Value &v) { return BufferFromVector(v, BE_FLOAT); }
+    ENDDECL1(buffer_of_floats, "xs", "V", "B",
+        "creates a float buffer from a vector of numbers. nested vectors (e.g. a list of xyz) are flattened");
+
+    STARTDECL(buffer_of_ints) (Value &v) { return BufferFromVector(v, BE_INT); }
+    ENDDECL1(buffer_of_ints, "xs", "V", "B",
+        "creates an int buffer from a vector of numbers. nested vectors are flattened");
+
+    STARTDECL(buffer_of_bytes) (Value &v) { return BufferFromVector(v, BE_BYTE); }
+    ENDDECL1(buffer_of_bytes, "xs", "V", "B",
+        "creates a byte buffer from a vector of numbers (truncated to 0..255). nested vectors are flattened");
+
+    STARTDECL(buffer_to_vector) (Value &b)
+    {
+        auto v = g_vm->NewVector(b.bval->len, V_VECTOR);
+        for (int i = 0; i < b.bval->len; i++) v->push(b.bval->at(i));
+        b.DECRT();
+        return Value(v);
+    }
+    ENDDECL1(buffer_to_vector, "buf", "B", "V",
+        "returns the contents of a buffer as a vector of ints or floats");
+
+    STARTDECL(buffer_kind) (Value &b)
+    {
+        auto s = g_vm->NewString(LBuffer::ElemName(b.bval->elemtype));
+        b.DECRT();
+        return Value(s);
+    }
+    ENDDECL1(buffer_kind, "buf", "B", "S",
+        "returns the element kind of a buffer: \"float\", \"int\" or \"byte\"");
+
+    STARTDECL(buffer_slice) (Value &b, Value &s, Value &e)
+    {
+        auto buf = b.bval;
+        int size = e.ival;
+        if (size < 0) size = buf->len + size;
+        int start = s.ival;
+        if (start < 0) start = buf->len + start;
+        if (start < 0 || size < 0 || start + size > buf->len)
+            g_vm->BuiltinError("buffer_slice: values out of range");
+        auto nb = g_vm->NewBuffer(size, buf->elemtype);
+        int es = LBuffer::ElemSize(buf->elemtype);
+        memcpy(nb->bdata(), buf->bdata() + start * es, size * es);
+        b.DECRT();
+        return Value(nb);
+    }
+    ENDDECL3(buffer_slice, "buf,start,size", "BII", "B",
+        "returns a new buffer of size elements copied from index start."
+        " start & size can be negative to indicate an offset from the buffer length.");
+
+    STARTDECL(buffer_copy) (Value &dst, Value &di, Value &src)
+    {
+        auto d = dst.bval, s = src.bval;
+        if (d->elemtype != s->elemtype)
+            g_vm->BuiltinError("buffer_copy: buffers must be of the same kind");
+        if (di.ival < 0 || di.ival + s->len > d->len)
+            g_vm->BuiltinError("buffer_copy: values out of range");
+        int es = LBuffer::ElemSize(d->elemtype);
+        memmove((uchar *)(d + 1) + di.ival * es, s + 1, s->bytes());
+        src.DECRT();
+        return dst;
+    }
+    ENDDECL3(buffer_copy, "dst,index,src", "BIB", "B",
+        "copies all of src into dst starting at index, returns dst");
+
+    STARTDECL(buffer_add) (Value &b, Value &x) { return BufferOp<BufAdd>(b, x, "buffer_add"); }
+    ENDDECL2(buffer_add, "buf,x", "BA", "B",
+        "adds x (a buffer of the same kind and length, or a number) to buf in place, returns buf");
+
+    STARTDECL(buffer_sub) (Value &b, Value &x) { return BufferOp<BufSub>(b, x, "buffer_sub"); }
+    ENDDECL2(buffer_sub, "buf,x", "BA", "B",
+        "subtracts x (a buffer of the same kind and length, or a number) from buf in place, returns buf");
+
+    STARTDECL(buffer_mul) (Value &b, Value &x) { return BufferOp<BufMul>(b, x, "buffer_mul"); }
+    ENDDECL2(buffer_mul, "buf,x", "BA", "B",
+        "multiplies buf by x (a buffer of the same kind and length, or a number) in place, returns buf");
+
+    STARTDECL(buffer_div) (Value &b, Value &x) { return BufferOp<BufDiv>(b, x, "buffer_div"); }
+    ENDDECL2(buffer_div, "buf,x", "BA", "B",
+        "divides buf by x (a buffer of the same kind and length, or a number) in place, returns buf");
+
+    STARTDECL(buffer_fill) (Value &b, Value &x)
+    {
+        CheckNumeric(x, "buffer_fill");
+        auto buf = b.bval;
+        switch (buf->elemtype)
+        {
+            case BE_FLOAT: fill(buf->fdata(), buf->fdata() + buf->len, ScalarAs<float>(x)); break;
+            case BE_INT:   fill(buf->idata(), buf->idata() + buf->len, ScalarAs<int>(x));   break;
+            default:       memset(buf->bdata(), ScalarAs<uchar>(x), buf->len);              break;
+        }
+        return b;
+    }
+    ENDDECL2(buffer_fill, "buf,x", "BA", "B",
+        "sets all elements of buf to the number x, returns buf");
+
+    STARTDECL(buffer_ramp) (Value &b, Value &start, Value &step)
+    {
+        auto buf = b.bval;
+        switch (buf->elemtype)
+        {
+            case BE_FLOAT: BufferRamp(buf->fdata(), buf->len, start.fval, step.fval); break;
+            case BE_INT:   BufferRamp(buf->idata(), buf->len, start.fval, step.fval); break;
+            default:       BufferRamp(buf->bdata(), buf->len, start.fval, step.fval); break;
+        }
+        return b;
+    }
+    ENDDECL3(buffer_ramp, "buf,start,step", "BFF", "B",
+        "sets element i of buf to start + step * i, returns buf");
+
+    STARTDECL(buffer_sum) (Value &b)
+    {
+        auto buf = b.bval;
+        double sum = 0;
+        for (int i = 0; i < buf->len; i++) sum += buf->atf(i);
+        b.DECRT();
+        return Value((float)sum);
+    }
+    ENDDECL1(buffer_sum, "buf", "B", "F",
+        "returns the sum of all elements of buf as a float");
+}
+
+AutoRegister __abuf("buffer", AddBuffer);
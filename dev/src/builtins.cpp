@@ -21,8 +21,6 @@
 
 using namespace lobster;
 
-static RandomNumberGenerator<MersenneTwister> rnd;
-
 int KeyCompare(const Value &a, const Value &b, bool rec = false)
 {
     if (a.type != b.type)
@@ -32,7 +30,7 @@ int KeyCompare(const Value &a, const Value &b, bool rec = false)
     {
         case V_INT:    return a.ival < b.ival ? -1 : a.ival > b.ival;
         case V_FLOAT:  return a.fval < b.fval ? -1 : a.fval > b.fval;
-        case V_STRING: return strcmp(a.sval->str(), b.sval->str());
+        case V_STRING: return a.sval == b.sval ? 0 : strcmp(a.sval->str(), b.sval->str());
 
         case V_VECTOR:
             if (a.vval->len && b.vval->len && !rec) return KeyCompare(a.vval->at(0), b.vval->at(0), true);
@@ -146,12 +144,17 @@ void AddBuiltins()
         {
             case V_INT:    return a;
             case V_VECTOR:
+            case V_BUFFER:
+            case V_HASHMAP:
+            case V_PVECTOR:
             case V_STRING: { auto len = a.lobj->len; a.DECRT(); return Value(len); }
+            case V_PQUEUE: { auto len = a.qval->size(); a.DECRT(); return Value(len); }
+            case V_STRINGBUILDER: { auto len = (int)a.sbval->buf.size(); a.DECRT(); return Value(len); }
             default: return g_vm->BuiltinError("illegal type passed to length");
         }
     }
     ENDDECL1(length, "xs", "A", "I",
-        "length of vector/string/int");
+        "length of vector/string/buffer/hashmap/pqueue/stringbuilder/pvector/int");
 
     STARTDECL(equal) (Value &a, Value &b)
     {
@@ -196,9 +199,14 @@ void AddBuiltins()
     {
         if (i.ival < 0 || i.ival >= l.vval->len) g_vm->BuiltinError("replace: index out of range");
 
-        auto nv = g_vm->NewVector(l.vval->len, l.vval->type);
-        nv->append(l.vval, 0, l.vval->len);
-        l.DECRT();
+        // if nothing else refers to xs, nobody can tell the difference between modifying it and a copy
+        LVector *nv = l.vval;
+        if (!nv->Unique())
+        {
+            nv = g_vm->NewVector(l.vval->len, l.vval->type);
+            nv->append(l.vval, 0, l.vval->len);
+            l.DECRT();
+        }
 
         Value &dest = nv->at(i.ival);
         dest.DEC();
@@ -207,7 +215,8 @@ void AddBuiltins()
         return Value(nv);
     }
     ENDDECL3(replace, "xs,i,x", "VIA", "V",
-        "returns a copy of a vector with the element at i replaced by x");
+        "returns a copy of a vector with the element at i replaced by x. if xs isn't referred to by anything"
+        " else (e.g. it is the result of another function), it is modified in place instead.");
 
     STARTDECL(insert) (Value &l, Value &i, Value &a, Value &n)
     {
@@ -289,13 +298,24 @@ void AddBuiltins()
 
     STARTDECL(copy) (Value &v)
     {
-        auto nv = g_vm->NewVector(v.vval->len, v.vval->type);
-        nv->append(v.vval, 0, v.vval->len);
+        LVector *nv;
+        // small vectors (like most structs) are cheaper to copy right away than to share
+        if (v.vval->len < 16)
+        {
+            nv = g_vm->NewVector(v.vval->len, v.vval->type);
+            nv->append(v.vval, 0, v.vval->len);
+        }
+        else
+        {
+            nv = g_vm->NewVector(0, v.vval->type);
+            nv->ShareBuf(v.vval);
+        }
         v.DECRT();
         return Value(nv);
     }
     ENDDECL1(copy, "xs", "V", "V1",
-        "makes a shallow copy of vector/object.");
+        "makes a shallow copy of vector/object. for larger vectors this is O(1): the elements are only actually"
+        " copied when either vector is first modified.");
 
     STARTDECL(slice) (Value &l, Value &s, Value &e)
     {
@@ -358,13 +378,14 @@ void AddBuiltins()
         if (start < 0 || start + size > (int)l.vval->len)
             g_vm->BuiltinError("substring: values out of range");
 
-        auto ns = g_vm->NewString(l.sval->str() + start, size);
+        auto ns = g_vm->SubString(l.sval, start, size);
         l.DECRT();
         return Value(ns);
     }
     ENDDECL3(substring, "s,start,size", "SII", "S", 
         "returns a substring of size characters from index start."
-        " start & size can be negative to indicate an offset from the string length.");
+        " start & size can be negative to indicate an offset from the string length."
+        " a long enough substring that runs to the end of s shares its characters instead of copying them.");
 
     STARTDECL(tokenize) (Value &s, Value &delims, Value &whitespace)
     {
@@ -414,15 +435,14 @@ void AddBuiltins()
     {
         ValueRef sref(s);
         auto v = g_vm->NewVector(s.sval->len, V_VECTOR);
-        ValueRef vref((Value(v)));
         const char *p = s.sval->str();
         while (*p)
         {
             int u = FromUTF8(p);
-            if (u < 0) return Value(0, V_NIL);
+            if (u < 0) { Value(v).DECRT(); return Value(0, V_NIL); }
             v->push(u);
         }
-        return Value(v).INC();
+        return Value(v);
     }
     ENDDECL1(string2unicode, "s", "S", "I]?",
         "converts a UTF-8 string into a vector of unicode values, or nil upon a decoding error");
@@ -447,6 +467,15 @@ void AddBuiltins()
         "converts the (unsigned version) of the input integer number to a string given the base (2..36, e.g. 16 for"
         " hex) and outputting a minimum of characters (padding with 0).");
 
+    STARTDECL(intern) (Value &s)
+    {
+        return Value(g_vm->Intern(s.sval));
+    }
+    ENDDECL1(intern, "s", "S", "S",
+        "returns the interned string equal to s. interned strings are shared, have their hash computed once, and"
+        " comparing two of them for equality is a pointer compare, so this speeds up strings used as keys in"
+        " hashmaps or compared often. they live until the program ends. string constants are always interned.");
+
     #define VECTOROP(name, op, otype) \
         if (a.type == V_VECTOR) { \
             auto v = g_vm->NewVector(a.vval->len, a.vval->type); \
@@ -549,13 +578,13 @@ void AddBuiltins()
     ENDDECL2(cross, "a,b", "F]F]", "F]",
         "a perpendicular vector to the 2D plane defined by a and b (swap a and b for its inverse)");
 
-    STARTDECL(rnd) (Value &a) { return Value(rnd(max(1, a.ival))); } ENDDECL1(rnd, "max", "I", "I",
+    STARTDECL(rnd) (Value &a) { return Value(g_vm->rnd(max(1, a.ival))); } ENDDECL1(rnd, "max", "I", "I",
         "a random value [0..max).");
-    STARTDECL(rnd) (Value &a) { VECTOROPI(rnd, rnd(max(1, f.ival))); } ENDDECL1(rnd, "max", "I]", "I]",
+    STARTDECL(rnd) (Value &a) { VECTOROPI(rnd, g_vm->rnd(max(1, f.ival))); } ENDDECL1(rnd, "max", "I]", "I]",
         "a random vector within the range of an input vector.");
-    STARTDECL(rndfloat)() { return Value((float)rnd.rnddouble()); } ENDDECL0(rndfloat, "", "", "F",
+    STARTDECL(rndfloat)() { return Value((float)g_vm->rnd.rnddouble()); } ENDDECL0(rndfloat, "", "", "F",
         "a random float [0..1)");
-    STARTDECL(rndseed) (Value &seed) { rnd.seed(seed.ival); return Value(); } ENDDECL1(rndseed, "seed", "I", "",
+    STARTDECL(rndseed) (Value &seed) { g_vm->rnd.seed(seed.ival); return Value(); } ENDDECL1(rndseed, "seed", "I", "",
         "explicitly set a random seed for reproducable randomness");
 
     STARTDECL(div) (Value &a, Value &b) { return Value(float(a.ival) / float(b.ival)); } ENDDECL2(div, "a,b", "II", "F",
@@ -689,6 +718,33 @@ void AddBuiltins()
     ENDDECL1(active, "coroutine", "R", "I",
         "wether the given coroutine is still active");
 
+    STARTDECL(schedule) (Value &cos)
+    {
+        g_vm->Push(cos);    // keep it reachable for collect_garbage() while coroutines run
+        auto now = g_vm->Time();
+        int numactive = 0;
+        for (int i = 0; i < cos.vval->len; i++)    // they may add to it, which get their first turn this same call
+        {
+            auto co = cos.vval->at(i);
+            if (co.type != V_COROUTINE) g_vm->BuiltinError("schedule: vector must contain only coroutines");
+            if (!co.cval->active) continue;
+            if (co.cval->running) { numactive++; continue; }    // the one calling us, or one that resumed it
+            co.INC();   // it may well remove itself
+            auto &wait = co.cval->Current();
+            if (wait.type == V_INT && wait.ival > 1) wait.ival--;
+            else if (wait.type != V_FLOAT || wait.fval <= now) g_vm->CoRunUntilYield(co.cval, Value(0, V_NIL));
+            if (co.cval->active) numactive++;
+            co.DECRT();
+        }
+        g_vm->Pop().DECRT();
+        return Value(numactive);
+    }
+    ENDDECL1(schedule, "coroutines", "V", "I",
+        "resumes each active coroutine in the vector once, until it yields again or finishes (call this once per"
+        " frame). what a coroutine last yielded says when it wants to run: an int n > 1 skips this many calls minus"
+        " one (counting down its yield value in place), a float waits until seconds_elapsed() reaches it, anything"
+        " else runs every call. the coroutines may change the vector. returns how many are still active.");
+
     STARTDECL(program_name) ()
     {
         return Value(g_vm->NewString(g_vm->GetProgramName()));
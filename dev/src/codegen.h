@@ -26,17 +26,18 @@ namespace lobster
     F(PUSHIDX) F(LVALIDX) \
     F(PUSHFLDO) F(PUSHFLDC) F(PUSHFLDT) F(PUSHFLDMO) F(PUSHFLDMC) F(PUSHFLDMT) F(LVALFLDO) F(LVALFLDC) F(LVALFLDT) \
     F(PUSHLOC) F(LVALLOC) \
-    F(BCALL) \
+    F(BCALL) F(BCALLT) \
     F(CALL) F(CALLV) F(CALLVCOND) F(DUP) F(CONT1) \
     F(FUNSTART) F(FUNEND) F(FUNMULTI) F(CALLMULTI) \
     F(JUMP) \
     F(NEWVEC) \
     F(POP) \
-    F(EXIT) \
+    F(EXIT) F(CALLBACKRET) \
     F(IADD) F(ISUB) F(IMUL) F(IDIV) F(IMOD) F(ILT) F(IGT) F(ILE) F(IGE) F(IEQ) F(INE) \
     F(FADD) F(FSUB) F(FMUL) F(FDIV) F(FMOD) F(FLT) F(FGT) F(FLE) F(FGE) F(FEQ) F(FNE) \
     F(AADD) F(ASUB) F(AMUL) F(ADIV) F(AMOD) F(ALT) F(AGT) F(ALE) F(AGE) F(AEQ) F(ANE) \
-    F(UMINUS) F(LOGNOT) F(I2F) F(A2S) F(JUMPFAIL) F(JUMPFAILR) F(JUMPNOFAIL) F(JUMPNOFAILR) F(RETURN) F(FOR) \
+    F(SIADD) F(SISUB) F(SIMUL) F(SIDIV) F(SFADD) F(SFSUB) F(SFMUL) F(SFDIV) \
+    F(UMINUS) F(IUMINUS) F(FUMINUS) F(LOGNOT) F(I2F) F(A2S) F(JUMPFAIL) F(JUMPFAILR) F(JUMPNOFAIL) F(JUMPNOFAILR) F(RETURN) F(FOR) \
     F(PUSHONCE) F(PUSHPARENT) \
     F(TTSTRUCT) F(TT) F(TTFLT) F(TTSTR) F(ISTYPE) F(CORO) F(COCL) F(COEND) \
     F(FIELDTABLES) F(LOGREAD)
@@ -62,12 +63,26 @@ struct CodeGen
     vector<const Node *> linenumbernodes;
     vector<pair<int, const SubFunction *>> call_fixups;
     SymbolTable &st;
+    int typechecks_removed;
+    int numconststrings;
+
+    struct CoroutineTable
+    {
+        vector<int> slots;      // ident idx of each variable of the coroutine state, -1 for unused slots
+        const char *err;
+        bool found;
+    };
+    map<const Node *, CoroutineTable> cotables;     // for each T_COROUTINE
+    map<int, int> coslots;                          // ident idx -> its slot in any table it is part of
 
     CodeGen(Parser &_p, SymbolTable &_st, vector<int> &_code, vector<LineInfo> &_lineinfo, bool verbose)
-        : code(_code), lineinfo(_lineinfo), lex(_p.lex), parser(_p), st(_st)
+        : code(_code), lineinfo(_lineinfo), lex(_p.lex), parser(_p), st(_st), typechecks_removed(0),
+          numconststrings(0)
     {
         linenumbernodes.push_back(parser.root);
 
+        AssignCoroutineSlots();
+
         GenFieldTables(st, verbose);
 
         BodyGen(parser.root);
@@ -91,6 +106,9 @@ struct CodeGen
             assert(!code[fixup.first]);
             code[fixup.first] = bytecodestart;
         }
+
+        if (verbose && typechecks_removed)
+            printf("runtime type checks removed thanks to the typechecker: %d\n", typechecks_removed);
     }
 
     ~CodeGen()
@@ -115,6 +133,80 @@ struct CodeGen
 
     void Dummy(int retval) { while (retval--) Emit(IL_PUSHUNDEF); }
 
+    // Gives every variable that is part of the state of any coroutine a slot, the same in every coroutine it is part
+    // of, such that variables in the same coroutine get different slots. co.var@fun then indexes the state of the
+    // coroutine directly (IL_PUSHLOC / IL_LVALLOC), and tables stay short as long as unrelated coroutines don't
+    // share variables.
+    void AssignCoroutineSlots()
+    {
+        vector<const Node *> coros;
+        std::function<void(const Node *)> collect = [&](const Node *n)
+        {
+            if (!n) return;
+            if (n->type == T_COROUTINE) coros.push_back(n);
+            if (n->HasChildren()) { collect(n->a()); collect(n->b()); }
+        };
+        collect(parser.root);
+        for (auto f : st.functiontable) for (auto sf = f->subf; sf; sf = sf->next) collect(sf->body);
+
+        map<int, set<int>> sharing;     // variables that are part of the same coroutine state as a variable
+        vector<int> order;              // in order of first use, so slots are deterministic
+        for (auto n : coros)
+        {
+            auto &ct = cotables[n];
+            ct.found = false;
+            ct.err = n->child()->FindIdentsUpToYield([&](const vector<const Ident *> &istack)
+            {
+                ct.found = true;
+                for (auto id : istack)
+                {
+                    // FIXME: merging of variables from all yield sites is potentially incorrect, we might end
+                    // up restoring variables that are not actually in use
+                    if (find(ct.slots.begin(), ct.slots.end(), id->idx) == ct.slots.end())
+                        ct.slots.push_back(id->idx);
+                    //printf("cor: %s\n", id->name.c_str());
+                }
+            });
+            for (auto i : ct.slots)
+            {
+                if (sharing.find(i) == sharing.end()) order.push_back(i);
+                auto &sh = sharing[i];
+                for (auto j : ct.slots) if (j != i) sh.insert(j);
+            }
+        }
+
+        for (auto i : order)
+        {
+            set<int> taken;
+            for (auto j : sharing[i])
+            {
+                auto it = coslots.find(j);
+                if (it != coslots.end()) taken.insert(it->second);
+            }
+            int slot = 0;
+            while (taken.count(slot)) slot++;
+            coslots[i] = slot;
+        }
+
+        for (auto &it : cotables)
+        {
+            vector<int> slots;
+            for (auto i : it.second.slots)
+            {
+                auto slot = coslots[i];
+                if (slot >= (int)slots.size()) slots.resize(slot + 1, -1);
+                slots[slot] = i;
+            }
+            it.second.slots = slots;
+        }
+    }
+
+    int CoroutineSlot(const Ident *id)
+    {
+        auto it = coslots.find(id->idx);
+        return it == coslots.end() ? -1 : it->second;   // not part of any coroutine, an error at runtime
+    }
+
     void BodyGen(Node *n)
     {
         for (; n; n = n->tail()) Gen(n->head(), !n->tail());
@@ -237,9 +329,27 @@ struct CodeGen
         if (!retval) Emit(IL_POP);  // FIXME: always the case with while body
     }
 
+    // Returns whether a value of static type given is guaranteed to pass a runtime check against type.
+    // Without the typechecker, all exptypes are V_ANY, so this only kicks in with -t.
+    bool StaticallyOfType(const Type &given, const Type &type)
+    {
+        if (given == type) return true;
+        switch (type.t)
+        {
+            case V_ANY:     return true;
+            case V_STRUCT:  return given.t == V_STRUCT && st.IsSuperTypeOrSame(type.idx, given.idx);
+            case V_VECTOR:  return given.t == V_VECTOR || given.t == V_STRUCT;  // Structs are vectors at runtime.
+            case V_NILABLE: return given.t == V_NIL ||
+                                   (given.t == V_NILABLE && StaticallyOfType(given.Element(), type.Element())) ||
+                                   StaticallyOfType(given, type.Element());
+            default:        return given.t == type.t;
+        }
+    }
+
     void GenTypeCheck(const Type &given, const Type &type)
     {
         if (given == type) return;
+        if (StaticallyOfType(given, type)) { typechecks_removed++; return; }
         switch(type.t)
         {
             case V_ANY:     break;
@@ -262,7 +372,15 @@ struct CodeGen
         {
             case T_INT:   if (retval) { Emit(IL_PUSHINT, n->integer()); }; break;
             case T_FLOAT: if (retval) { Emit(IL_PUSHFLT); int2float i2f; i2f.f = (float)n->flt(); Emit(i2f.i); }; break; 
-            case T_STR:   if (retval) { Emit(IL_PUSHSTR); for (const char *p = n->str(); *p; p++) Emit(*p); Emit(0); }; break;
+            case T_STR:
+                if (retval)
+                {
+                    // slot index for the VM to cache the interned string in, then length and characters
+                    Emit(IL_PUSHSTR, numconststrings++, (int)strlen(n->str()));
+                    for (const char *p = n->str(); *p; p++) Emit(*p);
+                    Emit(0);
+                }
+                break;
             case T_NIL:   if (retval) { Emit(IL_PUSHNIL); break; }
 
             case T_IDENT:  if (retval) { Emit(IL_PUSHVAR, n->ident()->idx); }; break;
@@ -281,7 +399,11 @@ struct CodeGen
 
             case T_CO_AT:
                 Gen(n->coroutine_at(), retval);
-                if (retval) Emit(IL_PUSHLOC, n->coroutine_var()->ident()->idx);
+                if (retval)
+                {
+                    auto id = n->coroutine_var()->ident();
+                    Emit(IL_PUSHLOC, id->idx, CoroutineSlot(id));
+                }
                 break;
 
             case T_DEF:
@@ -340,15 +462,26 @@ struct CodeGen
                 Gen(n->right(), retval);
                 if (retval)
                 {
-                    if (n->left()->exptype.t == V_INT) Emit(IL_IADD + opc);
-                    else if (n->left()->exptype.t == V_FLOAT) Emit(IL_FADD + opc);
+                    int nfields;
+                    auto &lt = n->left()->exptype;
+                    if (lt.t == V_INT) Emit(IL_IADD + opc);
+                    else if (lt.t == V_FLOAT) Emit(IL_FADD + opc);
+                    else if (opc <  IL_IMOD - IL_IADD && (nfields = ScalarStruct(lt, n->right()->exptype, V_INT)))
+                        Emit(IL_SIADD + opc, nfields);
+                    else if (opc <  IL_FMOD - IL_FADD && (nfields = ScalarStruct(lt, n->right()->exptype, V_FLOAT)))
+                        Emit(IL_SFADD + opc, nfields);
                     else Emit(IL_AADD + opc);
                 }
                 break;
 
             case T_UMINUS:
                 Gen(n->child(), retval);
-                if (retval) Emit(IL_UMINUS);
+                if (retval)
+                {
+                    if (n->child()->exptype.t == V_INT) Emit(IL_IUMINUS);
+                    else if (n->child()->exptype.t == V_FLOAT) Emit(IL_FUMINUS);
+                    else Emit(IL_UMINUS);
+                }
                 break;
 
             case T_I2F:
@@ -421,9 +554,28 @@ struct CodeGen
                     // TODO: could pass arg types in here if most exps have types, cheaper than doing it all in call
                     // instruction?
                     genargs(n->ncall_args(), nullptr, 0);
+                    // If the typechecker has proven all args are of the right type (inserting coercions where
+                    // needed), the VM doesn't need to check them.
+                    int ncheck = 0;
+                    bool typed = true;
+                    int i = 0;
+                    for (auto list = n->ncall_args(); list; list = list->tail())
+                    {
+                        if (i >= (int)nf->args.v.size()) { typed = false; break; }  // VM gives the error.
+                        auto &argtype = nf->args.v[i++].type;
+                        if (argtype.t == V_ANY) continue;
+                        if (!StaticallyOfType(list->head()->exptype, argtype)) { typed = false; break; }
+                        ncheck++;
+                    }
+                    auto bcall = IL_BCALL;
+                    if (typed)
+                    {
+                        bcall = IL_BCALLT;
+                        typechecks_removed += ncheck;
+                    }
                     if (nf->ncm == NCM_CONT_EXIT)  // graphics.h
                     {   
-                        Emit(IL_BCALL, nf->idx, nargs);
+                        Emit(bcall, nf->idx, nargs);
                         if (lastarg->type != T_NIL) // FIXME: this will not work if its a var with nil value
                         {
                             Emit(IL_CALLVCOND, 0);
@@ -432,7 +584,7 @@ struct CodeGen
                     }
                     else
                     {
-                        Emit(IL_BCALL, nf->idx, nargs);
+                        Emit(bcall, nf->idx, nargs);
                     }
                     if (nf->retvals.v.size() > 1)
                     {
@@ -644,32 +796,22 @@ struct CodeGen
 
                 if (retval)
                 {
-                    bool found = false;
-                    Emit(0); // count
-                    // TODO: we shouldn't need to compute and store this table for each call, instead do it once for
-                    // each function / builtin function
-                    auto err = n->child()->FindIdentsUpToYield([&](const vector<const Ident *> &istack)
-                    {
-                        found = true;
-                        for (auto id : istack)
-                        {
-                            for (size_t i = loc + 1; i < code.size(); i++) if (code[i] == id->idx) continue;
-                            // FIXME: merging of variables from all yield sites is potentially incorrect, we might end
-                            // up restoring variables that are not actually in use
-                            Emit(id->idx);
-                            //printf("cor: %s\n", id->name.c_str());
-                        }
-                    });
+                    auto it = cotables.find(n);
+                    assert(it != cotables.end());
+                    auto &ct = it->second;
 
-                    if (err)
-                        parser.Error(string("coroutine construction error: ") + err, n->child());
+                    if (ct.err)
+                        parser.Error(string("coroutine construction error: ") + ct.err, n->child());
 
                     // this guarantees FindIdentsUpToYield has done an accurate job finding all ids, since if it can
                     // reach the yield, it must also have found the whole callchain leading up to it
                     // if people start storing the yield function inside data structures or doing other weird things to
                     // confuse the algorithm, they'll at least get this error
-                    if (!found)
+                    if (!ct.found)
                         parser.Error("coroutine construction error: cannot find yield call", n->child());
+
+                    Emit((int)ct.slots.size());
+                    for (auto i : ct.slots) Emit(i);
                     code[loc] = code.size() - loc - 1;
                 }
 
@@ -704,6 +846,18 @@ struct CodeGen
         linenumbernodes.pop_back();
     }
 
+    // For arithmetic between two structs of the same type whose fields are all of scalar type elem (e.g.
+    // struct rgb: [ r:float, g:float, b:float ], or the int/float versions the typechecker makes of xy/xyz/xyzw),
+    // returns the number of fields, such that a specialized opcode can be used. The opcode checks the values it gets
+    // at runtime, since they may be a subclass, or not hold to the field types at all (see SOP in vm.h).
+    int ScalarStruct(const Type &lt, const Type &rt, ValueType elem)
+    {
+        if (lt.t != V_STRUCT || lt != rt) return 0;
+        auto struc = st.structtable[lt.idx];
+        if (struc->vectortype.t != V_VECTOR || struc->vectortype.Element().t != elem) return 0;
+        return (int)struc->fields.size();
+    }
+
     void GenAssign(const Node *lval, int lvalop, int retval, const Node *rhs = nullptr)
     {
         if (retval) lvalop++;
@@ -712,7 +866,13 @@ struct CodeGen
         {
             case T_IDENT: Emit(IL_LVALVAR, lvalop, lval->ident()->idx); break;
             case T_DOT:   Gen(lval->left(), 1); GenFieldAccess(lval->right()->fld(), lvalop, false); break;
-            case T_CO_AT: Gen(lval->coroutine_at(), 1); Emit(IL_LVALLOC, lvalop, lval->coroutine_var()->ident()->idx); break;
+            case T_CO_AT:
+            {
+                Gen(lval->coroutine_at(), 1);
+                auto id = lval->coroutine_var()->ident();
+                Emit(IL_LVALLOC, lvalop, id->idx, CoroutineSlot(id));
+                break;
+            }
             case T_INDEX: Gen(lval->left(), 1); Gen(lval->right(), 1); Emit(IL_LVALIDX, lvalop); break;
             default:    parser.Error("lvalue required", lval);
         }
@@ -740,6 +900,9 @@ struct CodeGen
         Emit(IL_FIELDTABLES, 0);
         MARKL(loc);
 
+        // at a fixed location (skipped over like the tables), used as return address by VM::EvalC
+        Emit(IL_CALLBACKRET);
+
         for (auto f : st.fieldtable)
         {
             if (f->numunique == 1) continue;
@@ -65,6 +65,8 @@ static int *DisAsmIns(FILE *f, SymbolTable &st, int *ip, int *code, const LineIn
         case IL_TT:
         case IL_TTSTRUCT:
         case IL_LOGREAD:
+        case IL_SIADD: case IL_SISUB: case IL_SIMUL: case IL_SIDIV:
+        case IL_SFADD: case IL_SFSUB: case IL_SFMUL: case IL_SFDIV:
             fprintf(f, "%d", *ip++);
             break;
 
@@ -94,6 +96,7 @@ static int *DisAsmIns(FILE *f, SymbolTable &st, int *ip, int *code, const LineIn
         }
 
         case IL_BCALL:
+        case IL_BCALLT:
         {
             int a = *ip++;
             fprintf(f, "%s %d", natreg.nfuns[a]->name.c_str(), *ip++);
@@ -108,16 +111,23 @@ static int *DisAsmIns(FILE *f, SymbolTable &st, int *ip, int *code, const LineIn
 
         case IL_LVALFLDO:
         case IL_LVALFLDT:
-        case IL_LVALLOC:
            LvalDisAsm(f, ip);
         case IL_PUSHFLDT:
         case IL_PUSHFLDO:
         case IL_PUSHFLDMT:
         case IL_PUSHFLDMO:
-        case IL_PUSHLOC:
             fprintf(f, "%d", *ip++);
             break;
 
+        case IL_LVALLOC:
+            LvalDisAsm(f, ip);
+        case IL_PUSHLOC:
+        {
+            int i = *ip++;
+            fprintf(f, "%s (slot %d)", st.ReverseLookupIdent(i).c_str(), *ip++);
+            break;
+        }
+
         case IL_LVALFLDC:
            LvalDisAsm(f, ip);
         case IL_PUSHFLDC:
@@ -139,6 +149,7 @@ static int *DisAsmIns(FILE *f, SymbolTable &st, int *ip, int *code, const LineIn
             break;
 
         case IL_PUSHSTR:
+            ip += 2;    // slot, length
             fprintf(f, "\"");
             while(*ip) fprintf(f, "%c", *ip++);
             ip++;
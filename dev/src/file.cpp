@@ -19,6 +19,11 @@
 
 #include "stdint.h"
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
 #ifdef WIN32
     #define VC_EXTRALEAN
     #define WIN32_LEAN_AND_MEAN
@@ -30,90 +35,591 @@
     #endif
     #include <sys/types.h>
     #include <sys/stat.h>
+    #include <sys/mman.h>
     #include <unistd.h>
+    #include <fcntl.h>
+    #include <dirent.h>
 #endif
 
 using namespace lobster;
 
-void AddDirItem(LVector *list, const char *filename, int64_t size, int divisor)
+// An open file being read with file_read_line / file_read_chunk. Reads ahead into a buffer, which grows if a single
+// line or chunk needs more.
+struct FileReader
+{
+    FILE *f;
+    vector<char> buf;
+    size_t pos, end;
+
+    FileReader(FILE *_f) : f(_f), buf(64 * 1024), pos(0), end(0) {}
+    ~FileReader() { fclose(f); }
+
+    size_t avail() const { return end - pos; }
+    const char *data() const { return buf.data() + pos; }
+
+    // tries to have n bytes buffered, false if the file doesn't have that many left
+    bool Fill(size_t n)
+    {
+        if (avail() >= n) return true;
+        if (pos) { memmove(buf.data(), data(), avail()); end -= pos; pos = 0; }
+        if (buf.size() < n) buf.resize(max(n, buf.size() * 2));
+        while (end < buf.size())
+        {
+            auto r = fread(buf.data() + end, 1, buf.size() - end, f);
+            if (!r) break;
+            end += r;
+        }
+        return avail() >= n;
+    }
+};
+
+// Handle tables are shared by all VMs in the process, which may run on different threads.
+static mutex handlemtx;
+static IntResourceManagerCompact<FileReader> *openfiles = nullptr;
+
+static FileReader *GetFile(Value &h)
 {
-    auto elem = g_vm->NewVector(2, V_VECTOR);
-    elem->push(Value(g_vm->NewString(filename, strlen(filename))));
-    if (size >= 0)
+    FileReader *fr;
     {
-        size /= divisor;
-        if (size > 0x7FFFFFFF) size = 0x7FFFFFFF;
+        lock_guard<mutex> lock(handlemtx);
+        fr = openfiles ? openfiles->Get(h.ival) : nullptr;
     }
-    elem->push(Value(int(size)));
-    list->push(Value(elem));
+    if (!fr) g_vm->BuiltinError("file: illegal file handle");
+    return fr;
 }
 
-void AddFileOps()
+#ifndef WIN32
+
+// Maps a file into memory as the characters of a string, with the LString header just in front of it in an anonymous
+// page. Mapping beyond the end of the file is zero filled, which gives the string its terminator.
+static LString *MapString(FILE *f)
 {
-    STARTDECL(scan_folder) (Value &fld, Value &divisor)
+    struct stat st;
+    if (fstat(fileno(f), &st) || st.st_size <= 0 || st.st_size > 0x7FFFFFFF) return nullptr;
+    size_t len = (size_t)st.st_size;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t total = page + (len + page) / page * page;
+    auto region = (char *)mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) return nullptr;
+    if (mmap(region + page, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fileno(f), 0) == MAP_FAILED)
     {
-        string folder = SanitizePath(fld.sval->str());
-        fld.DEC();
+        munmap(region, total);
+        return nullptr;
+    }
+    auto s = new (region + page - sizeof(LString)) LString((int)len);
+    s->mapped = true;
+    return s;
+}
 
-        if (divisor.ival <= 0) divisor.ival = 1;
+void lobster::UnmapString(LString *s)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    munmap((char *)(s + 1) - page, page + (s->len + page) / page * page);
+}
 
-        #ifdef WIN32
+#else
+
+// A view of a file can only be placed at the allocation granularity (64K), not directly after an LString header, so
+// on Windows read_file always makes a copy. No string is ever marked mapped, so there is no UnmapString either.
+static LString *MapString(FILE *) { return nullptr; }
 
-        WIN32_FIND_DATA fdata;
-        HANDLE fh = FindFirstFile((folder + "\\*.*").c_str(), &fdata);
-        if (fh == INVALID_HANDLE_VALUE) return Value(0, V_NIL);
+#endif
 
-        auto list = g_vm->NewVector(0, V_VECTOR);
+typedef vector<pair<string, int64_t>> DirItems;    // name, size (-1 if directory)
 
-        do
+// Doesn't touch the VM, so can also run on an I/O thread.
+static bool ScanFolder(const string &folder, DirItems &items)
+{
+    #ifdef WIN32
+
+    WIN32_FIND_DATA fdata;
+    HANDLE fh = FindFirstFile((folder + "\\*.*").c_str(), &fdata);
+    if (fh == INVALID_HANDLE_VALUE) return false;
+
+    do
+    {
+        if (strcmp(fdata.cFileName, ".") && strcmp(fdata.cFileName, ".."))
+        {
+            ULONGLONG size = (static_cast<ULONGLONG>(fdata.nFileSizeHigh) << (sizeof(uint) * 8)) | 
+                             fdata.nFileSizeLow;
+            items.push_back(make_pair(string(fdata.cFileName),
+                                      fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? -1 : (int64_t)size));
+        }
+    }
+    while(FindNextFile(fh, &fdata));
+    FindClose(fh);
+    return true;
+
+    #elif !defined(__ANDROID__)
+
+    glob_t gl;
+    string mask = folder + "/*";
+    if (glob(mask.c_str(), GLOB_MARK | GLOB_TILDE, nullptr, &gl)) return false;
+
+    for (size_t fi = 0; fi < gl.gl_pathc; fi++)
+    {
+        string xFileName = gl.gl_pathv[fi];
+        bool isDir = xFileName[xFileName.length()-1] == '/';
+        if (isDir) xFileName = xFileName.substr(0, xFileName.length() - 1);
+        string cFileName = xFileName.substr(xFileName.find_last_of('/') + 1);
+        struct stat st;
+        stat(gl.gl_pathv[fi], &st);
+
+        items.push_back(make_pair(cFileName, isDir ? -1 : (int64_t)st.st_size));
+    }
+    globfree(&gl);
+    return true;
+
+    #else
+
+    return false;
+
+    #endif
+}
+
+static Value DirList(const DirItems &items, int divisor)
+{
+    auto list = g_vm->NewVector((int)items.size(), V_VECTOR);
+    for (auto &item : items)
+    {
+        auto elem = g_vm->NewVector(2, V_VECTOR);
+        elem->push(Value(g_vm->NewString(item.first)));
+        auto size = item.second;
+        if (size >= 0)
+        {
+            size /= divisor;
+            if (size > 0x7FFFFFFF) size = 0x7FFFFFFF;
+        }
+        elem->push(Value(int(size)));
+        list->push(Value(elem));
+    }
+    return Value(list);
+}
+
+// A file operation started by read_file_async() etc. An I/O thread runs it using only the plain C++ members below,
+// Values are made from the results on the VM thread once it is done, since g_vm and vmpool are not thread safe.
+struct AsyncFileOp
+{
+    enum Kind { READ, WRITE, SCAN };
+
+    Kind kind;
+    string filename;
+    string data;        // contents to write, or contents read
+    int divisor;
+    DirItems items;
+    bool ok;
+    bool done;          // protected by AsyncIO::mtx
+
+    AsyncFileOp(Kind _k, const char *_fn) : kind(_k), filename(_fn), divisor(1), ok(false), done(false) {}
+
+    void Run()
+    {
+        switch (kind)
         {
-            if (strcmp(fdata.cFileName, ".") && strcmp(fdata.cFileName, ".."))
+            case READ:
             {
-                ULONGLONG size = (static_cast<ULONGLONG>(fdata.nFileSizeHigh) << (sizeof(uint) * 8)) | 
-                                 fdata.nFileSizeLow;
-                AddDirItem(list, fdata.cFileName, fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ? -1 : size,
-                           divisor.ival);
+                size_t sz = 0;
+                auto buf = (char *)LoadFile(filename.c_str(), &sz);
+                if (!buf) return;
+                data.assign(buf, sz);
+                free(buf);
+                ok = true;
+                break;
             }
+            case WRITE:
+            {
+                FILE *f = OpenForWriting(filename.c_str(), true);
+                if (!f) return;
+                ok = data.empty() || fwrite(data.data(), data.size(), 1, f) == 1;
+                fclose(f);
+                break;
+            }
+            case SCAN:
+                ok = ScanFolder(SanitizePath(filename.c_str()), items);
+                break;
         }
-        while(FindNextFile(fh, &fdata));
-        FindClose(fh);
-        return Value(list);
+    }
 
-        #elif !defined(__ANDROID__)
+    // What the blocking version of this operation would have returned.
+    Value Result()
+    {
+        switch (kind)
+        {
+            case READ:  return ok ? Value(g_vm->NewString(data)) : Value(0, V_NIL);
+            case WRITE: return Value(ok);
+            default:    return ok ? DirList(items, divisor) : Value(0, V_NIL);
+        }
+    }
+};
 
-        glob_t gl;
-        string mask = folder + "/*";
-        if (glob(mask.c_str(), GLOB_MARK | GLOB_TILDE, nullptr, &gl)) return Value(0, V_NIL);
+// Threads that run AsyncFileOps in the order they were started. Created on first use and never destroyed, the
+// threads are simply abandoned at program exit.
+struct AsyncIO
+{
+    mutex mtx;
+    condition_variable queued, finished;
+    deque<AsyncFileOp *> queue;
 
-        auto list = g_vm->NewVector(0, V_VECTOR);
+    AsyncIO()
+    {
+        auto n = min(4u, max(1u, thread::hardware_concurrency()));
+        for (uint i = 0; i < n; i++) thread([this]() { Work(); }).detach();
+    }
 
-        for (size_t fi = 0; fi < gl.gl_pathc; fi++)
+    void Work()
+    {
+        unique_lock<mutex> lock(mtx);
+        for (;;)
         {
-            string xFileName = gl.gl_pathv[fi];
-            bool isDir = xFileName[xFileName.length()-1] == '/';
-            if (isDir) xFileName = xFileName.substr(0, xFileName.length() - 1);
-            string cFileName = xFileName.substr(xFileName.find_last_of('/') + 1);
-            struct stat st;
-            stat(gl.gl_pathv[fi], &st);
+            queued.wait(lock, [this]() { return !queue.empty(); });
+            auto op = queue.front();
+            queue.pop_front();
+            lock.unlock();
+            op->Run();
+            lock.lock();
+            op->done = true;
+            finished.notify_all();
+        }
+    }
 
-            AddDirItem(list, cFileName.c_str(), isDir ? -1 : st.st_size, divisor.ival);
+    void Start(AsyncFileOp *op)
+    {
+        lock_guard<mutex> lock(mtx);
+        queue.push_back(op);
+        queued.notify_one();
+    }
+
+    bool Done(AsyncFileOp *op)
+    {
+        lock_guard<mutex> lock(mtx);
+        return op->done;
+    }
+
+    void Wait(AsyncFileOp *op)
+    {
+        unique_lock<mutex> lock(mtx);
+        finished.wait(lock, [op]() { return op->done; });
+    }
+};
+
+static AsyncIO *asyncio = nullptr;
+static IntResourceManagerCompact<AsyncFileOp> *asyncops = nullptr;
+
+static Value StartAsync(AsyncFileOp *op)
+{
+    int h;
+    {
+        lock_guard<mutex> lock(handlemtx);
+        if (!asyncio)
+        {
+            asyncio = new AsyncIO();
+            asyncops = new IntResourceManagerCompact<AsyncFileOp>([](AsyncFileOp *op) { delete op; });
         }
-        globfree(&gl);
-        return Value(list);
+        h = (int)asyncops->Add(op);
+    }
+    asyncio->Start(op);
+    return Value(h);
+}
 
-        #else
+static AsyncFileOp *GetAsync(Value &h)
+{
+    AsyncFileOp *op;
+    {
+        lock_guard<mutex> lock(handlemtx);
+        op = asyncops ? asyncops->Get(h.ival) : nullptr;
+    }
+    if (!op) g_vm->BuiltinError("async: illegal handle (each result can only be retrieved once)");
+    return op;
+}
 
-        return Value(0, V_NIL);
+// Waits for the operation if needed, and frees its handle.
+static Value AsyncResult(Value &h)
+{
+    auto op = GetAsync(h);
+    asyncio->Wait(op);
+    auto r = op->Result();
+    lock_guard<mutex> lock(handlemtx);
+    asyncops->Delete(h.ival);
+    return r;
+}
+
+struct TreeFile
+{
+    string name;
+    int64_t size;
+    int64_t mtime;      // seconds since 1970
+};
 
-        #endif
+// The contents of one directory, as read by ReadDir().
+struct DirContents
+{
+    int64_t mtime;
+    vector<TreeFile> files;
+    vector<string> subdirs;
+};
+
+#ifdef WIN32
+static int64_t UnixTime(const FILETIME &ft)
+{
+    return (int64_t)((((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10000000ULL) - 11644473600LL;
+}
+#endif
+
+static bool DirMTime(const string &path, int64_t &mtime)
+{
+    #ifdef WIN32
+        WIN32_FILE_ATTRIBUTE_DATA fad;
+        if (!GetFileAttributesEx(path.c_str(), GetFileExInfoStandard, &fad)) return false;
+        mtime = UnixTime(fad.ftLastWriteTime);
+    #else
+        struct stat st;
+        if (stat(path.c_str(), &st)) return false;
+        mtime = st.st_mtime;
+    #endif
+    return true;
+}
+
+// One directory listing plus one stat per file, relative to the open directory (fstatat) so the kernel doesn't have
+// to resolve the whole path again for each. Symlinks to directories are not followed, to not get stuck in cycles.
+static bool ReadDir(const string &path, DirContents &dc)
+{
+    #ifdef WIN32
+
+    if (!DirMTime(path, dc.mtime)) return false;
+    WIN32_FIND_DATA fdata;
+    HANDLE fh = FindFirstFile((path + "\\*.*").c_str(), &fdata);
+    if (fh == INVALID_HANDLE_VALUE) return false;
+    do
+    {
+        if (!strcmp(fdata.cFileName, ".") || !strcmp(fdata.cFileName, "..")) continue;
+        if (fdata.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+        if (fdata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            dc.subdirs.push_back(fdata.cFileName);
+        }
+        else
+        {
+            TreeFile tf = { fdata.cFileName, (int64_t)(((ULONGLONG)fdata.nFileSizeHigh << 32) | fdata.nFileSizeLow),
+                            UnixTime(fdata.ftLastWriteTime) };
+            dc.files.push_back(tf);
+        }
+    }
+    while(FindNextFile(fh, &fdata));
+    FindClose(fh);
+    return true;
+
+    #else
+
+    int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) return false;
+    struct stat st;
+    DIR *d = fstat(fd, &st) ? nullptr : fdopendir(fd);
+    if (!d) { close(fd); return false; }
+    dc.mtime = st.st_mtime;
+    while (auto e = readdir(d))
+    {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+        if (e->d_type == DT_DIR) { dc.subdirs.push_back(e->d_name); continue; }
+        // symlinks to files are listed as those files, symlinks to directories are skipped
+        if (fstatat(fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+        bool link = S_ISLNK(st.st_mode);
+        if (link && fstatat(fd, e->d_name, &st, 0)) continue;   // a dangling symlink
+        if (S_ISDIR(st.st_mode))
+        {
+            if (!link) dc.subdirs.push_back(e->d_name);     // only gets here if d_type is DT_UNKNOWN
+            continue;
+        }
+        TreeFile tf = { e->d_name, (int64_t)st.st_size, (int64_t)st.st_mtime };
+        dc.files.push_back(tf);
+    }
+    closedir(d);    // also closes fd
+    return true;
+
+    #endif
+}
+
+// Directory contents from earlier scan_tree() calls, by full path. An entry is valid as long as the directory's mtime
+// hasn't changed, which happens when files are added, removed or renamed, but not when a file is modified in place.
+static map<string, DirContents> *dircache = nullptr;
+static mutex dircachemtx;
+
+// Walks a tree breadth first from a shared list of pending directories, so any number of threads can help.
+struct TreeScanner
+{
+    string root;
+    vector<string> exts;
+    int64_t since;
+    bool cached;
+
+    mutex mtx;
+    condition_variable cv;
+    vector<string> pending;     // relative to root, "" or ending in '/'
+    int busy;
+    bool rootfailed;
+    vector<TreeFile> results;   // with names relative to root
+
+    TreeScanner(const string &_root, bool _cached)
+        : root(_root), since(0), cached(_cached), busy(0), rootfailed(false)
+    {
+        pending.push_back("");
+    }
+
+    bool Get(const string &path, DirContents &dc)
+    {
+        if (cached)
+        {
+            int64_t mtime;
+            if (!DirMTime(path, mtime)) return false;
+            lock_guard<mutex> lock(dircachemtx);
+            if (!dircache) dircache = new map<string, DirContents>();
+            auto it = dircache->find(path);
+            if (it != dircache->end() && it->second.mtime == mtime) { dc = it->second; return true; }
+        }
+        if (!ReadDir(path, dc)) return false;
+        // a directory changed in the current second may still change without its mtime changing
+        if (cached && dc.mtime < (int64_t)time(nullptr) - 1)
+        {
+            lock_guard<mutex> lock(dircachemtx);
+            (*dircache)[path] = dc;
+        }
+        return true;
+    }
+
+    bool Wanted(const TreeFile &tf)
+    {
+        if (tf.mtime < since) return false;
+        if (exts.empty()) return true;
+        for (auto &ext : exts)
+            if (tf.name.size() >= ext.size() && !tf.name.compare(tf.name.size() - ext.size(), ext.size(), ext))
+                return true;
+        return false;
+    }
+
+    void Work()
+    {
+        unique_lock<mutex> lock(mtx);
+        for (;;)
+        {
+            cv.wait(lock, [this]() { return !pending.empty() || !busy; });
+            if (pending.empty()) return;    // and nobody busy that could add more: done
+            auto rel = pending.back();
+            pending.pop_back();
+            busy++;
+            lock.unlock();
+
+            DirContents dc;
+            bool ok = Get(root + "/" + rel, dc);
+            vector<TreeFile> found;
+            for (auto &tf : dc.files) if (Wanted(tf))
+            {
+                found.push_back(tf);
+                found.back().name = rel + tf.name;
+            }
+
+            lock.lock();
+            if (!ok && rel.empty()) rootfailed = true;
+            for (auto &sd : dc.subdirs) pending.push_back(rel + sd + "/");
+            results.insert(results.end(), found.begin(), found.end());
+            busy--;
+            cv.notify_all();
+        }
+    }
+
+    void Run(int nthreads)
+    {
+        vector<thread> helpers;
+        for (int i = 1; i < nthreads; i++) helpers.push_back(thread([this]() { Work(); }));
+        Work();
+        for (auto &t : helpers) t.join();
+        sort(results.begin(), results.end(), [](const TreeFile &a, const TreeFile &b) { return a.name < b.name; });
+    }
+};
+
+void AddFileOps()
+{
+    STARTDECL(scan_folder) (Value &fld, Value &divisor)
+    {
+        string folder = SanitizePath(fld.sval->str());
+        fld.DEC();
+
+        if (divisor.ival <= 0) divisor.ival = 1;
+
+        DirItems items;
+        if (!ScanFolder(folder, items)) return Value(0, V_NIL);
+        return DirList(items, divisor.ival);
     }
     ENDDECL2(scan_folder, "folder,divisor", "SI", "I",
         "returns a vector of all elements in a folder, each element is [ name,  filesize (-1 if directory) ]."
         " Specify 1 as divisor to get sizes in bytes, 1024 for kb etc. Values > 0x7FFFFFFF will be clamped."
         " Returns nil if folder couldn't be scanned.");
 
-    STARTDECL(read_file) (Value &file)
+    STARTDECL(scan_tree) (Value &fld, Value &extensions, Value &since, Value &parallel, Value &cached)
+    {
+        auto folder = SanitizePath(fld.sval->str());
+        TreeScanner ts(folder.empty() ? "." : folder, cached.True());
+        fld.DEC();
+        if (extensions.type == V_VECTOR)
+        {
+            for (int i = 0; i < extensions.vval->len; i++)
+            {
+                auto &e = extensions.vval->at(i);
+                if (e.type != V_STRING) g_vm->BuiltinError("scan_tree: extensions must be strings");
+                ts.exts.push_back(string(e.sval->str(), e.sval->len));
+            }
+        }
+        extensions.DEC();
+        ts.since = since.ival;
+        ts.Run(parallel.True() ? (int)min(8u, max(1u, thread::hardware_concurrency())) : 1);
+        if (ts.rootfailed)
+        {
+            g_vm->Push(Value(0, V_NIL));
+            g_vm->Push(Value(0, V_NIL));
+            return Value(0, V_NIL);
+        }
+        int n = (int)ts.results.size();
+        auto names = g_vm->NewVector(n, V_VECTOR);
+        auto sizes = g_vm->NewVector(n, V_VECTOR);
+        auto mtimes = g_vm->NewVector(n, V_VECTOR);
+        for (auto &tf : ts.results)
+        {
+            names->push(Value(g_vm->NewString(tf.name)));
+            sizes->push(Value((int)min(tf.size, (int64_t)0x7FFFFFFF)));
+            mtimes->push(Value((int)tf.mtime));
+        }
+        g_vm->Push(Value(names));
+        g_vm->Push(Value(sizes));
+        return Value(mtimes);
+    }
+    ENDDECL5(scan_tree, "folder,extensions,since,parallel,cached", "Sviii", "VVV",
+        "returns all files in a folder and all its sub folders (not following symlinks to folders), as 3 vectors:"
+        " names (relative to folder, using / as separator, sorted), sizes in bytes (clamped to 0x7FFFFFFF) and"
+        " modification times (seconds since 1970). optionally only files whose name ends in one of extensions"
+        " (e.g. [ \".png\", \".jpg\" ]), or that were modified at or after since. parallel scans folders using"
+        " multiple threads. cached remembers the contents of each folder, so a later scan only needs to check"
+        " the modification time of each folder: faster, but doesn't notice files that were modified without"
+        " being added, removed or renamed. returns nil 3 times if folder can't be read.");
+
+    STARTDECL(read_file) (Value &file, Value &mapped)
     {
+        if (mapped.True())
+        {
+            auto f = OpenForReading(file.sval->str());
+            file.DEC();
+            if (!f) return Value(0, V_NIL);
+            auto s = MapString(f);
+            if (!s)
+            {
+                // empty file or no mmap: read it the normal way
+                fseek(f, 0, SEEK_END);
+                auto len = ftell(f);
+                fseek(f, 0, SEEK_SET);
+                vector<char> buf(len);
+                if (len > 0 && fread(buf.data(), len, 1, f) != 1) { fclose(f); return Value(0, V_NIL); }
+                s = g_vm->NewString(buf.data(), (int)len);
+            }
+            fclose(f);
+            return Value(s);
+        }
         size_t sz = 0;
         auto buf = (char *)LoadFile(file.sval->str(), &sz);
         file.DEC();
@@ -122,25 +628,156 @@ void AddFileOps()
         free(buf);
         return Value(s);
     }
-    ENDDECL1(read_file, "file", "S", "S",
+    ENDDECL2(read_file, "file,mapped", "Si", "S",
         "returns the contents of a file as a string, or nil if the file can't be found."
-        " you may use either \\ or / as path separators");
+        " you may use either \\ or / as path separators. if mapped is true, the string is the file memory mapped"
+        " instead of a copy (except on windows, where it is always a copy): nothing is read until used, and only"
+        " what is used needs to be in memory, useful for very large files. the file should not be modified while"
+        " the string exists.");
 
     STARTDECL(write_file) (Value &file, Value &contents)
     {
+        if (contents.type != V_BUFFER) g_vm->BuiltinCheck(contents, V_STRING, "write_file");
         FILE *f = OpenForWriting(file.sval->str(), true);
         file.DEC();
         size_t written = 0;
         if (f)
         {
-            written = fwrite(contents.sval->str(), contents.sval->len, 1, f);
+            if (contents.type == V_BUFFER)
+                written = contents.bval->len ? fwrite(contents.bval->bdata(), contents.bval->bytes(), 1, f) : 1;
+            else
+                written = fwrite(contents.sval->str(), contents.sval->len, 1, f);
             fclose(f);
         }
         contents.DEC();
         return Value(written == 1);
     }
-    ENDDECL2(write_file, "file,contents", "SS", "I",
-        "creates a file with the contents of a string, returns false if writing wasn't possible");
+    ENDDECL2(write_file, "file,contents", "SA", "I",
+        "creates a file with the contents of a string (or the raw data of a buffer),"
+        " returns false if writing wasn't possible");
+
+    STARTDECL(file_open) (Value &file)
+    {
+        auto f = OpenForReading(file.sval->str());
+        file.DEC();
+        if (!f) return Value(0);
+        lock_guard<mutex> lock(handlemtx);
+        if (!openfiles) openfiles = new IntResourceManagerCompact<FileReader>([](FileReader *fr) { delete fr; });
+        return Value((int)openfiles->Add(new FileReader(f)));
+    }
+    ENDDECL1(file_open, "file", "S", "I",
+        "opens a file for reading a piece at a time with file_read_line() / file_read_chunk(), without loading all"
+        " of it into memory. returns a file handle, or 0 if the file can't be found. close with file_close().");
+
+    STARTDECL(file_read_line) (Value &h)
+    {
+        auto fr = GetFile(h);
+        size_t scanned = 0;
+        for (;;)
+        {
+            auto nl = (const char *)memchr(fr->data() + scanned, '\n', fr->avail() - scanned);
+            size_t len = nl ? nl - fr->data() : fr->avail();
+            if (!nl)
+            {
+                scanned = fr->avail();
+                if (fr->Fill(scanned + 1)) continue;
+                if (!scanned) return Value(0, V_NIL);  // end of file
+                len = scanned;
+            }
+            auto line = fr->data();
+            fr->pos += len + (nl ? 1 : 0);
+            if (len && line[len - 1] == '\r') len--;
+            return Value(g_vm->NewString(line, (int)len));
+        }
+    }
+    ENDDECL1(file_read_line, "handle", "I", "S",
+        "returns the next line of the file without its line ending, or nil at the end of the file");
+
+    STARTDECL(file_read_chunk) (Value &h, Value &size)
+    {
+        auto fr = GetFile(h);
+        if (size.ival <= 0) g_vm->BuiltinError("file_read_chunk: size must be positive");
+        fr->Fill(size.ival);
+        if (!fr->avail()) return Value(0, V_NIL);
+        int len = min(size.ival, (int)fr->avail());
+        auto s = g_vm->NewString(fr->data(), len);
+        fr->pos += len;
+        return Value(s);
+    }
+    ENDDECL2(file_read_chunk, "handle,size", "II", "S",
+        "returns the next size bytes of the file (fewer only at the end of the file), or nil at the end of the file");
+
+    STARTDECL(file_close) (Value &h)
+    {
+        GetFile(h);
+        lock_guard<mutex> lock(handlemtx);
+        openfiles->Delete(h.ival);
+        return Value(0, V_NIL);
+    }
+    ENDDECL1(file_close, "handle", "I", "",
+        "closes a file opened with file_open()");
+
+    STARTDECL(read_file_async) (Value &file)
+    {
+        auto op = new AsyncFileOp(AsyncFileOp::READ, file.sval->str());
+        file.DEC();
+        return StartAsync(op);
+    }
+    ENDDECL1(read_file_async, "file", "S", "I",
+        "starts reading a file on a background thread, like read_file(). returns a handle to pass to async_done(),"
+        " async_result() or async_resume().");
+
+    STARTDECL(write_file_async) (Value &file, Value &contents)
+    {
+        if (contents.type != V_BUFFER) g_vm->BuiltinCheck(contents, V_STRING, "write_file_async");
+        auto op = new AsyncFileOp(AsyncFileOp::WRITE, file.sval->str());
+        file.DEC();
+        // a copy, since the original may change or go away before the write happens
+        if (contents.type == V_BUFFER) op->data.assign((char *)contents.bval->bdata(), contents.bval->bytes());
+        else                           op->data.assign(contents.sval->str(), contents.sval->len);
+        contents.DEC();
+        return StartAsync(op);
+    }
+    ENDDECL2(write_file_async, "file,contents", "SA", "I",
+        "starts writing a file on a background thread, like write_file(). returns a handle, see read_file_async()."
+        " operations may run concurrently, so wait for a write to finish before reading or writing the same file.");
+
+    STARTDECL(scan_folder_async) (Value &fld, Value &divisor)
+    {
+        auto op = new AsyncFileOp(AsyncFileOp::SCAN, fld.sval->str());
+        fld.DEC();
+        op->divisor = max(divisor.ival, 1);
+        return StartAsync(op);
+    }
+    ENDDECL2(scan_folder_async, "folder,divisor", "SI", "I",
+        "starts scanning a folder on a background thread, like scan_folder(). returns a handle, see"
+        " read_file_async().");
+
+    STARTDECL(async_done) (Value &h)
+    {
+        return Value(asyncio->Done(GetAsync(h)));
+    }
+    ENDDECL1(async_done, "handle", "I", "I",
+        "wether the async operation has completed, i.e. async_result() will not block");
+
+    STARTDECL(async_result) (Value &h)
+    {
+        return AsyncResult(h);
+    }
+    ENDDECL1(async_result, "handle", "I", "A",
+        "returns what the blocking version of the async operation returns (e.g. the file contents or nil for"
+        " read_file_async()), waiting for it to complete if it hasn't yet. frees the handle.");
+
+    STARTDECL(async_resume) (Value &h, Value &co)
+    {
+        if (!asyncio->Done(GetAsync(h))) return co;
+        auto r = AsyncResult(h);
+        g_vm->CoResume(co.cval);
+        return r;
+    }
+    ENDDECL2(async_resume, "handle,coroutine", "IR", "R",
+        "if the async operation has completed, resumes the coroutine, passing it the result (as async_result())."
+        " otherwise does nothing. returns the coroutine. see async_step() in std.lobster.");
 }
 
 AutoRegister __afo("file", AddFileOps);
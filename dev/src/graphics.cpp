@@ -637,32 +637,53 @@ void AddGraphics()
     {
         TestGL();
 
+        CheckVectorOrBuffer(indices, "newmesh");
+        CheckVectorOrBuffer(positions, "newmesh");
+        CheckVectorOrBuffer(colors, "newmesh");
+        CheckVectorOrBuffer(texcoords, "newmesh");
+        CheckVectorOrBuffer(normals, "newmesh");
+
+        int nverts = ValueElemCount(positions, 3);
+        int ncols  = ValueElemCount(colors, 4);
+        int ntcs   = ValueElemCount(texcoords, 2);
+        int nnorms = ValueElemCount(normals, 3);
+
         vector<int> idxs;
-        for (int i = 0; i < indices.vval->len; i++)
+        int nidxs = ValueElemCount(indices, 1);
+        if (indices.type == V_BUFFER && indices.bval->elemtype == BE_FLOAT)
+            g_vm->BuiltinError("newmesh: index buffer must be of ints");
+        for (int i = 0; i < nidxs; i++)
         {
-            auto &e = indices.vval->at(i);
-            if (e.type != V_INT) g_vm->BuiltinError("newmesh: index list must be all integers");
-            if (e.ival < 0 || e.ival >= positions.vval->len)
+            int idx;
+            if (indices.type == V_BUFFER)
+            {
+                idx = indices.bval->at(i).ival;
+            }
+            else
+            {
+                auto &e = indices.vval->at(i);
+                if (e.type != V_INT) g_vm->BuiltinError("newmesh: index list must be all integers");
+                idx = e.ival;
+            }
+            if (idx < 0 || idx >= nverts)
                 g_vm->BuiltinError("newmesh: index out of range of vertex list");
-            idxs.push_back(e.ival);
+            idxs.push_back(idx);
         }
         indices.DECRT();
 
-        int nverts = positions.vval->len;
-
         BasicVert *verts = new BasicVert[nverts];
         BasicVert v = { float3_0, float3_0, float2_0, byte4_255 };
 
         for (int i = 0; i < nverts; i++)
         {
-            v.pos  = ValueTo<float3>(positions.vval->at(i), 0);
-            v.col  = i < colors.vval->len    ? quantizec(ValueTo<float4>(colors.vval->at(i), 1)) : byte4_255;
-            v.tc   = i < texcoords.vval->len ? ValueTo<float3>(texcoords.vval->at(i), 0).xy()     : v.pos.xy();
-            v.norm = i < normals.vval->len   ? ValueTo<float3>(normals.vval->at(i), 0)            : float3_0;
+            v.pos  = ValueElemTo<float3>(positions, i, 3, 0);
+            v.col  = i < ncols  ? quantizec(ValueElemTo<float4>(colors, i, 4, 1))  : byte4_255;
+            v.tc   = i < ntcs   ? ValueElemTo<float3>(texcoords, i, 2, 0).xy()      : v.pos.xy();
+            v.norm = i < nnorms ? ValueElemTo<float3>(normals, i, 3, 0)             : float3_0;
             verts[i] = v;
         }
 
-        if (!normals.vval->len)
+        if (!nnorms)
         {
             // if no normals were specified, generate them. if the user really doesn't use normals and this step is
             // somehow too expensive, he can always pass in the positions vector a second time to skip it
@@ -681,8 +702,10 @@ void AddGraphics()
 
         return Value((int)meshes->Add(m));
     }
-    ENDDECL5(gl_newmesh, "indices,positions,colors,texcoords,normals", "VVVVV", "I",
+    ENDDECL5(gl_newmesh, "indices,positions,colors,texcoords,normals", "AAAAA", "I",
         "creates a new vertex buffer and returns an integer id (1..) for it."
+        " each argument can be a vector of vectors, or a flat buffer (int indices, 3 floats per position,"
+        " 4 per color, 2 per texcoord, 3 per normal)."
         " you may specify [] to get defaults for colors (white) / texcoords (position x & y) /"
         " normals (generated from adjacent triangles)");
 
@@ -0,0 +1,101 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+using namespace lobster;
+
+static Value HashMapElems(Value &m, bool keys)
+{
+    auto hm = m.hval;
+    auto v = g_vm->NewVector(hm->len, V_VECTOR);
+    for (int i = 0; i < hm->cap; i++) if (hm->slots[i].hash > LHashMap::TOMBSTONE)
+        v->push((keys ? hm->slots[i].key : hm->slots[i].val).INC());
+    m.DECRT();
+    return Value(v);
+}
+
+void AddHashMap()
+{
+    STARTDECL(hashmap) (Value &reserve)
+    {
+        return Value(g_vm->NewHashMap(reserve.ival));
+    }
+    ENDDECL1(hashmap, "reserve", "i", "H",
+        "creates a new empty hashmap. keys can be of any type, and are compared structurally (like equal())."
+        " optionally specify how many elements you expect to add to avoid reallocation.");
+
+    STARTDECL(hashmap_set) (Value &m, Value &key, Value &val)
+    {
+        m.hval->Set(key, val);
+        return m;
+    }
+    ENDDECL3(hashmap_set, "map,key,value", "HAA", "H",
+        "sets the value for key, replacing any existing value. returns the map."
+        " don't modify a vector after using it as a key.");
+
+    STARTDECL(hashmap_get) (Value &m, Value &key, Value &def)
+    {
+        auto v = m.hval->Get(key);
+        Value r = v ? v->INC() : def;
+        if (v) def.DEC();
+        key.DEC();
+        m.DECRT();
+        return r;
+    }
+    ENDDECL3(hashmap_get, "map,key,default", "HAA", "A",
+        "returns the value for key, or default if key is not present");
+
+    STARTDECL(hashmap_has) (Value &m, Value &key)
+    {
+        bool has = m.hval->Get(key) != nullptr;
+        key.DEC();
+        m.DECRT();
+        return Value(has);
+    }
+    ENDDECL2(hashmap_has, "map,key", "HA", "I",
+        "returns wether key is present in the map");
+
+    STARTDECL(hashmap_remove) (Value &m, Value &key)
+    {
+        Value v(0, V_NIL);
+        m.hval->Remove(key, v);
+        key.DEC();
+        m.DECRT();
+        return v;
+    }
+    ENDDECL2(hashmap_remove, "map,key", "HA", "A",
+        "removes key from the map, returns its value, or nil if it wasn't present");
+
+    STARTDECL(hashmap_clear) (Value &m)
+    {
+        m.hval->Clear();
+        return m;
+    }
+    ENDDECL1(hashmap_clear, "map", "H", "H",
+        "removes all elements from the map, returns the map");
+
+    STARTDECL(hashmap_keys) (Value &m) { return HashMapElems(m, true); }
+    ENDDECL1(hashmap_keys, "map", "H", "V",
+        "returns a vector of all keys, in no particular order");
+
+    STARTDECL(hashmap_values) (Value &m) { return HashMapElems(m, false); }
+    ENDDECL1(hashmap_values, "map", "H", "V",
+        "returns a vector of all values, in the same order as hashmap_keys()");
+}
+
+AutoRegister __ahm("hashmap", AddHashMap);
@@ -20,10 +20,17 @@
 //#include <huffman.h>
 #include "wentropy.h"
 
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+
 namespace lobster
 {
-    SlabAlloc *vmpool = nullptr;               // set during the lifetime of a VM object
-    static SlabAlloc *parserpool = nullptr;    // set during the lifetime of a Parser object
+    // These are per thread, so each thread can compile and run its own VM.
+    THREAD_LOCAL SlabAlloc *vmpool = nullptr;               // set during the lifetime of a VM object
+    static THREAD_LOCAL SlabAlloc *parserpool = nullptr;    // set during the lifetime of a Parser object
 }
 
 #include "vmdata.h"
@@ -32,8 +39,8 @@ namespace lobster
 namespace lobster
 {
     AutoRegister *autoreglist = nullptr;
-    NativeRegistry natreg;
-    VMBase *g_vm = nullptr;                    // set during the lifetime of a VM object
+    NativeRegistry natreg;                                  // read-only once main() has registered everything
+    THREAD_LOCAL VMBase *g_vm = nullptr;                    // set during the lifetime of a VM object
 }
 
 #include "ttypes.h"
@@ -44,6 +51,7 @@ namespace lobster
 #include "node.h"
 #include "parser.h"
 #include "typecheck.h"
+#include "optimizer.h"
 #include "codegen.h"
 #include "disasm.h"
 
@@ -65,6 +73,7 @@ struct CompiledProgram
         DISASM = 2,
         VERBOSE = 4,
         TYPECHECK = 8,
+        OPTIMIZE = 16,
     };
 
     void Compile(const char *fn, char *stringsource, int flags)
@@ -72,11 +81,16 @@ struct CompiledProgram
         Parser parser(fn, st, stringsource);
         parser.Parse();
 
-        if (flags & TYPECHECK)
+        if (flags & (TYPECHECK | OPTIMIZE))
         {
             TypeChecker tc(parser, st);
         }
 
+        if (flags & OPTIMIZE)  // needs types, so implies TYPECHECK
+        {
+            Optimizer opt(parser, st, (flags & VERBOSE) != 0);
+        }
+
         if (flags & PARSEDUMP)
         {
             auto dump = parser.Dump();
@@ -174,6 +188,125 @@ Value CompileRun(Value &source, bool stringiscode)
     }
 }
 
+// Runs a program in a VM of its own. Only call on a thread without a VM, see THREAD_LOCAL.
+// Returns false if there was an error, ret is then the error message.
+static bool CompileRunIsolated(string &src, string &ret)
+{
+    try
+    {
+        CompiledProgram cp;
+        cp.Compile("string", &src[0], 0);
+        cp.Run(ret, "string");
+        return true;
+    }
+    catch (string &s)
+    {
+        ret = s;
+        return false;
+    }
+}
+
+// Each program gets its own thread, and with it its own VM and vmpool.
+Value CompileRunThreads(Value &sources)
+{
+    vector<string> srcs;
+    for (int i = 0; i < sources.vval->len; i++)
+    {
+        auto &s = sources.vval->at(i);
+        if (s.type != V_STRING) g_vm->BuiltinError("compile_run_threads: sources must be strings");
+        srcs.push_back(string(s.sval->str(), s.sval->len));
+    }
+    sources.DEC();
+    vector<string> rets(srcs.size());
+    vector<uchar> ok(srcs.size(), false);   // not vector<bool>, whose elements share bytes
+    vector<thread> threads;
+    for (size_t i = 0; i < srcs.size(); i++)
+        threads.push_back(thread([&, i]() { ok[i] = CompileRunIsolated(srcs[i], rets[i]); }));
+    for (auto &t : threads) t.join();
+    auto retvec = g_vm->NewVector((int)srcs.size(), V_VECTOR);
+    auto errvec = g_vm->NewVector((int)srcs.size(), V_VECTOR);
+    for (size_t i = 0; i < srcs.size(); i++)
+    {
+        retvec->push(ok[i] ? Value(g_vm->NewString(rets[i])) : Value(0, V_NIL));
+        errvec->push(ok[i] ? Value(0, V_NIL) : Value(g_vm->NewString(rets[i])));
+    }
+    g_vm->Push(Value(retvec));
+    return Value(errvec);
+}
+
+// Isolates are programs running concurrently on threads of their own (thread_spawn()), talking to each other through
+// channels. VMs don't share heaps, so values travel as serialize() strings (see SerializeValue()).
+
+struct Channel
+{
+    deque<string> msgs;
+    bool closed;
+    condition_variable cv;
+
+    Channel() : closed(false) {}
+};
+
+struct Isolate
+{
+    string src, args, ret;
+    bool ok;
+    thread t;
+
+    Isolate() : ok(false) {}
+};
+
+// Shared by all threads. Handles are never reused, so using a stale one is an error rather than silently
+// referring to something else.
+static mutex isolatemtx;
+static map<int, shared_ptr<Channel>> *channels = nullptr;
+static map<int, Isolate *> *isolates = nullptr;
+static int lasthandle = 0;
+
+static THREAD_LOCAL const string *threadargs = nullptr;    // for thread_args()
+
+static shared_ptr<Channel> GetChannel(Value &h)
+{
+    shared_ptr<Channel> ch;
+    {
+        lock_guard<mutex> lock(isolatemtx);
+        if (channels)
+        {
+            auto it = channels->find(h.ival);
+            if (it != channels->end()) ch = it->second;
+        }
+    }
+    if (!ch) g_vm->BuiltinError("channel: illegal channel handle (closed and emptied?)");
+    return ch;
+}
+
+static string Marshal(Value &v, const char *name)
+{
+    string s;
+    try
+    {
+        s = SerializeValue(v);
+    }
+    catch (string &err)
+    {
+        v.DEC();
+        g_vm->BuiltinError(string(name) + ": " + err);
+    }
+    v.DEC();
+    return s;
+}
+
+static Value Unmarshal(const string &s, const char *name)
+{
+    try
+    {
+        return DeserializeValue(s);
+    }
+    catch (string &err)
+    {
+        return g_vm->BuiltinError(string(name) + ": " + err);
+    }
+}
+
 void AddCompiler()  // it knows how to call itself!
 {
     STARTDECL(compile_run_code) (Value &filename)
@@ -193,6 +326,135 @@ void AddCompiler()  // it knows how to call itself!
     }
     ENDDECL1(compile_run_file, "filename", "S", "AA",
         "same as compile_run_code(), only now you pass a filename.");
+
+    STARTDECL(compile_run_threads) (Value &sources)
+    {
+        return CompileRunThreads(sources);
+    }
+    ENDDECL1(compile_run_threads, "sources", "V", "VV",
+        "compiles and runs each string of lobster source in a vector like compile_run_code(), all at the same"
+        " time each in its own VM on its own thread. waits for all of them to finish, then returns a vector of"
+        " return values (as strings) and a vector of error strings (nil for those without errors). only"
+        " non-graphical builtins may be used by these programs.");
+
+    STARTDECL(thread_spawn) (Value &source, Value &args)
+    {
+        auto margs = Marshal(args, "thread_spawn");
+        auto iso = new Isolate();
+        iso->src = string(source.sval->str(), source.sval->len);
+        source.DEC();
+        iso->args.swap(margs);
+        int h;
+        {
+            lock_guard<mutex> lock(isolatemtx);
+            if (!isolates) isolates = new map<int, Isolate *>();
+            h = ++lasthandle;
+            (*isolates)[h] = iso;
+        }
+        iso->t = thread([iso]()
+        {
+            threadargs = &iso->args;
+            iso->ok = CompileRunIsolated(iso->src, iso->ret);
+        });
+        return Value(h);
+    }
+    ENDDECL2(thread_spawn, "source,args", "Sa", "I",
+        "compiles and runs lobster source like compile_run_code(), but in the background on a thread of its own,"
+        " isolated from the current program (its own VM and memory). the program can get a copy of args with"
+        " thread_args(). use channels (e.g. passed in args) to communicate with it while it runs. returns a thread"
+        " handle for thread_join(). only non-graphical builtins may be used by the program.");
+
+    STARTDECL(thread_args) ()
+    {
+        return threadargs ? Unmarshal(*threadargs, "thread_args") : Value(0, V_NIL);
+    }
+    ENDDECL0(thread_args, "", "", "A",
+        "returns a copy of the args passed to thread_spawn() that started the current program, or nil.");
+
+    STARTDECL(thread_join) (Value &h)
+    {
+        Isolate *iso = nullptr;
+        {
+            lock_guard<mutex> lock(isolatemtx);
+            if (isolates)
+            {
+                auto it = isolates->find(h.ival);
+                if (it != isolates->end()) { iso = it->second; isolates->erase(it); }
+            }
+        }
+        if (!iso) g_vm->BuiltinError("thread_join: illegal thread handle");
+        iso->t.join();
+        auto ret = Value(g_vm->NewString(iso->ret));
+        bool ok = iso->ok;
+        delete iso;
+        g_vm->Push(ok ? ret : Value(0, V_NIL));
+        return ok ? Value(0, V_NIL) : ret;
+    }
+    ENDDECL1(thread_join, "thread", "I", "AA",
+        "waits for a program started with thread_spawn() to end. returns its return value as a string, and an"
+        " error string as second return value (or nil if none), like compile_run_code().");
+
+    STARTDECL(channel) ()
+    {
+        lock_guard<mutex> lock(isolatemtx);
+        if (!channels) channels = new map<int, shared_ptr<Channel>>();
+        (*channels)[++lasthandle] = make_shared<Channel>();
+        return Value(lasthandle);
+    }
+    ENDDECL0(channel, "", "", "I",
+        "creates a channel that any program in this process (see thread_spawn()) can send values to and receive"
+        " them from, in order. returns its handle, an int, so it can be passed to other programs.");
+
+    STARTDECL(channel_send) (Value &h, Value &v)
+    {
+        auto ch = GetChannel(h);
+        auto msg = Marshal(v, "channel_send");
+        lock_guard<mutex> lock(isolatemtx);
+        if (ch->closed) return Value(false);
+        ch->msgs.push_back(msg);
+        ch->cv.notify_one();
+        return Value(true);
+    }
+    ENDDECL2(channel_send, "channel,value", "IA", "I",
+        "sends a copy of value (anything serialize() can handle) over a channel. returns false if the channel"
+        " has been closed.");
+
+    STARTDECL(channel_recv) (Value &h, Value &wait)
+    {
+        auto ch = GetChannel(h);
+        string msg;
+        {
+            unique_lock<mutex> lock(isolatemtx);
+            if (wait.True()) ch->cv.wait(lock, [&ch]() { return !ch->msgs.empty() || ch->closed; });
+            if (ch->msgs.empty())
+            {
+                // once closed and emptied, nothing can ever arrive again
+                if (ch->closed) channels->erase(h.ival);
+                lock.unlock();
+                g_vm->Push(Value(0, V_NIL));
+                return Value(false);
+            }
+            msg.swap(ch->msgs.front());
+            ch->msgs.pop_front();
+        }
+        g_vm->Push(Unmarshal(msg, "channel_recv"));
+        return Value(true);
+    }
+    ENDDECL2(channel_recv, "channel,wait", "Ii", "AI",
+        "receives the oldest value sent over a channel. if wait is true, waits for one to arrive (or the channel to"
+        " be closed). returns the value, and wether there was one as second return value (false if the channel is"
+        " empty, and nil is returned instead). after a closed channel has been emptied, its handle is invalid.");
+
+    STARTDECL(channel_close) (Value &h)
+    {
+        auto ch = GetChannel(h);
+        lock_guard<mutex> lock(isolatemtx);
+        ch->closed = true;
+        ch->cv.notify_all();
+        return Value(0, V_NIL);
+    }
+    ENDDECL1(channel_close, "channel", "I", "",
+        "closes a channel: further sends fail, and receivers get false once it is empty, instead of waiting.");
 }
 
 AutoRegister __ac("compiler", AddCompiler);
@@ -323,6 +585,7 @@ int main(int argc, char* argv[])
             if      (a == "-w") { wait = true; }
             else if (a == "-b") { bcf = default_bcf; }
             else if (a == "-t")          { flags |= CompiledProgram::TYPECHECK; }
+            else if (a == "-O")          { flags |= CompiledProgram::OPTIMIZE; }
             else if (a == "--verbose")   { flags |= CompiledProgram::VERBOSE; }
             else if (a == "--parsedump") { flags |= CompiledProgram::PARSEDUMP; }
             else if (a == "--disasm")    { flags |= CompiledProgram::DISASM; }
@@ -17,128 +17,315 @@
 #include "vmdata.h"
 #include "natreg.h"
 
-#include "ttypes.h"
-#include "lex.h"
-
 using namespace lobster;
 
+// Parses the data subset of lobster syntax (what you get when converting a data structure to a string): numbers,
+// strings, nil, and vectors / structs / hashmaps of those. Rather than going through the language lexer, this works
+// directly on the characters, so there are no temporary strings per token, and a vector isn't created until its
+// elements are known, at the exact size. Input comes from memory or is read from a file one chunk at a time.
 struct ValueParser
 {
-    vector<string> filenames;
-    vector<RefObj *> allocated;
-    Lex lex;
+    const char *p, *end;
+    FILE *f;
+    vector<char> chunk;
+    const char *name;
+    int line;
+    vector<Value> elems;        // elements of all vectors currently being parsed, innermost last, owned by us
+    string sbuf;                // reused for strings with escape codes, long numbers and type names
+
+    ValueParser(const char *src, size_t len) : p(src), end(src + len), f(nullptr), name("string"), line(1) {}
+
+    ValueParser(FILE *_f, const char *_name) : p(nullptr), end(nullptr), f(_f), chunk(64 * 1024), name(_name),
+                                               line(1) {}
 
-    ValueParser(char *_src) : lex("string", filenames, _src)
+    ~ValueParser()
     {
+        for (auto &e : elems) e.DEC();
     }
 
-    ~ValueParser()
+    void Error(const string &err)
+    {
+        throw string(name) + "(" + inttoa(line) + "): error: " + err;
+    }
+
+    // makes sure at least n characters are available if the input has them, keeping the ones not consumed yet
+    bool Fill(size_t n)
+    {
+        if ((size_t)(end - p) >= n) return true;
+        if (!f) return false;
+        size_t left = end - p;
+        if (left) memmove(chunk.data(), p, left);
+        left += fread(chunk.data() + left, 1, chunk.size() - left, f);
+        p = chunk.data();
+        end = p + left;
+        return left >= n;
+    }
+
+    int Peek(size_t ahead = 0) { return Fill(ahead + 1) ? (uchar)p[ahead] : -1; }
+
+    // skips whitespace and comments, returns wether a linefeed was crossed
+    bool Skip()
+    {
+        bool lf = false;
+        for (;;) switch (Peek())
+        {
+            case '\n': line++; lf = true;
+            case ' ': case '\t': case '\r': case '\f': p++; break;
+            case '/':
+                if (Peek(1) == '/')
+                {
+                    while (Peek() >= 0 && Peek() != '\n') p++;
+                    break;
+                }
+                if (Peek(1) == '*')
+                {
+                    p += 2;
+                    while (Peek() != '*' || Peek(1) != '/')
+                    {
+                        if (Peek() < 0) Error("end of file in multi-line comment");
+                        if (*p++ == '\n') line++;
+                    }
+                    p += 2;
+                    break;
+                }
+                return lf;
+            default:
+                return lf;
+        }
+    }
+
+    void Expect(char c)
     {
-        for (auto lo : allocated)
-            Value(lo).DECRT();
+        Skip();
+        if (Peek() != c) Error(string("\'") + c + "\' expected");
+        p++;
     }
 
     Value Parse()
     {
-        Value v = ParseFactor();
-        Gobble(T_LINEFEED);
-        Expect(T_ENDOFFILE);
+        Skip();
+        elems.push_back(ParseFactor());     // so it gets freed if what follows is an error
+        Skip();
+        if (Peek() >= 0) Error("end of data expected");
+        auto v = elems.back();
+        elems.pop_back();
         return v;
     }
 
+    // returns a value with a reference the caller takes over
     Value ParseFactor()
     {
-        switch (lex.token)
+        Skip();
+        int c = Peek();
+        switch (c)
         {
-            case T_INT:   { int i    = atoi(lex.sattr.c_str()); lex.Next(); return Value(i); }
-            case T_FLOAT: { double f = atof(lex.sattr.c_str()); lex.Next(); return Value((float)f); }
-            case T_STR:   { string s = lex.sattr;               lex.Next(); auto str = g_vm->NewString(s);
-                                                                            allocated.push_back(str);
-                                                                            return Value(str); }     
-            case T_NIL:   {                                     lex.Next(); return Value(0, V_NIL); }
-
-            case T_MINUS:
+            case '[': p++; return ParseList();
+            case '\"': p++; return Value(ParseString());
+            case '\'':
+            {
+                p++;
+                auto s = ParseString('\'');
+                if (s->len > 4) { Value(s).DECRT(); Error("character constant too long"); }
+                int ival = 0;
+                for (int i = 0; i < s->len; i++) ival = (ival << 8) + s->str()[i];
+                Value(s).DECRT();
+                return Value(ival);
+            }
+            case '-':
             {
-                lex.Next(); 
-                Value v = ParseFactor();
+                p++;
+                auto v = ParseFactor();
                 switch (v.type)
                 {
                     case V_INT:   v.ival *= -1; break;
                     case V_FLOAT: v.fval *= -1; break;
-                    default: lex.Error("numeric value expected");
+                    default: v.DEC(); Error("numeric value expected");
                 }
                 return v;
             }
+        }
+        if (isdigit(c) || (c == '.' && isdigit(Peek(1)))) return ParseNumber();
+        if (isalpha(c) || c == '_')
+        {
+            ParseIdent();
+            if (sbuf == "nil")   return Value(0, V_NIL);
+            if (sbuf == "true")  return Value(1);
+            if (sbuf == "false") return Value(0);
+            Error("illegal start of expression: " + sbuf);
+        }
+        Error(c < 0 ? string("unexpected end of data") : string("illegal start of expression: ") + (char)c);
+        return Value();
+    }
 
-            case T_LEFTBRACKET:
-            {
-                lex.Next();
-                Gobble(T_LINEFEED);
-                vector<Value> elems;
-                if (lex.token == T_RIGHTBRACKET) lex.Next();
-                else
-                {
-                    for (;;)
-                    {
-                        elems.push_back(ParseFactor());
-                        bool haslf = lex.token == T_LINEFEED;
-                        if (haslf) lex.Next();
-                        if (lex.token == T_RIGHTBRACKET) break;
-                        if (!haslf) Expect(T_COMMA);
-                    }
-                    lex.Next();
-                }
+    void ParseIdent()
+    {
+        sbuf.clear();
+        while (isalnum(Peek()) || Peek() == '_') sbuf += *p++;
+    }
 
-                int type = -1;
-                if (lex.token == T_COLON)
-                {
-                    lex.Next();
-                    string sname = lex.sattr;
-                    Expect(T_IDENT);
-                    size_t reqargs = 0;
-                    int idx = g_vm->StructIdx(sname, reqargs);
-                    if (idx >= 0)   // if unknown type, becomes regular vector
+    Value ParseNumber()
+    {
+        if (Peek() == '0' && Peek(1) == 'x')
+        {
+            p += 2;
+            int val = 0;
+            while (isxdigit(Peek())) { int c = *p++; val = (val << 4) | (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10); }
+            return Value(val);
+        }
+        // the digits are accumulated into an integer mantissa, which for anything that's not extremely long or
+        // precise gives an exact float by a single division, otherwise falls back on strtod
+        uint64_t mant = 0;
+        int frac = -1;
+        sbuf.clear();
+        for (;;)
+        {
+            int c = Peek();
+            if (isdigit(c)) { mant = mant * 10 + (c - '0'); if (frac >= 0) frac++; }
+            else if (c == '.' && frac < 0) frac = 0;
+            else break;
+            sbuf += *p++;
+        }
+        if (frac < 0) return Value((int)mant);
+        static const double pow10[] =
+        {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+        if (sbuf.size() <= 16 && frac <= 22) return Value((float)(mant / pow10[frac]));
+        return Value((float)strtod(sbuf.c_str(), nullptr));
+    }
+
+    LString *ParseString(int quote = '\"')
+    {
+        // common case: no escape codes, and the whole string is in the current chunk
+        for (auto s = p; s < end; s++)
+        {
+            if (*s == quote)
+            {
+                auto str = g_vm->NewString(p, (int)(s - p));
+                p = s + 1;
+                return str;
+            }
+            if (*s == '\\' || (uchar)*s < ' ' || *s == '\"' || *s == '\'') break;
+        }
+        sbuf.clear();
+        for (;;)
+        {
+            int c = Peek();
+            if (c == quote) { p++; break; }
+            switch (c)
+            {
+                case -1:
+                case '\n':
+                    Error("end of line found in string constant");
+                case '\'':
+                case '\"':
+                    Error("\' and \" should be prefixed with a \\ in a string constant");
+                case '\\':
+                    p++;
+                    switch (c = Peek())
                     {
-                        // pad with NIL if current type has more fields
-                        while (elems.size() < reqargs) { elems.push_back(Value(0, V_NIL)); }
-                        // drop elements if current type has less fields
-                        while (elems.size() > reqargs) { elems.back().DEC(); elems.pop_back(); }
-                        type = idx;
+                        case 'n': c = '\n'; break;
+                        case 't': c = '\t'; break;
+                        case 'r': c = '\r'; break;
+                        case '\\':
+                        case '\"':
+                        case '\'': break;
+                        case 'x':
+                        {
+                            p++;
+                            int h = Peek(), l = Peek(1);
+                            if (!isxdigit(h) || !isxdigit(l)) Error("illegal hexadecimal escape code in string constant");
+                            auto hex = [](int x) { return isdigit(x) ? x - '0' : (x | 0x20) - 'a' + 10; };
+                            c = (hex(h) << 4) | hex(l);
+                            p++;
+                            break;
+                        }
+                        default:
+                            Error("unknown control code in string constant");
                     }
-                }
-
-                auto vec = g_vm->NewVector(elems.size(), type);
-                allocated.push_back(vec);
-                for (auto &e : elems) vec->push(e.INC());
-                return Value(vec);
+                    break;
+                default:
+                    if (c < ' ') Error("unprintable character in string constant");
+                    break;
             }
-
-            default:
-                lex.Error("illegal start of expression: " + lex.TokStr());
-                return Value();
+            sbuf += (char)c;
+            p++;
         }
+        return g_vm->NewString(sbuf);
     }
 
-    void Expect(TType t)
+    Value ParseList()
     {
-        if (lex.token != t)
-            lex.Error(lex.TokStr(t) + " expected, found: " + lex.TokStr());
+        size_t start = elems.size();
+        bool pairs = false;     // elems are key, value, key, value... for a hashmap
+        if (Skip(), Peek() == ']') p++;
+        else for (;;)
+        {
+            elems.push_back(ParseFactor());
+            bool lf = Skip();
+            bool key = Peek() == ':';
+            if (elems.size() - start == 1) pairs = key;
+            if (key != pairs) Error("key: value pair expected");
+            if (key)
+            {
+                p++;
+                elems.push_back(ParseFactor());
+                lf = Skip();
+            }
+            if (Peek() == ']') { p++; break; }
+            if (Peek() == ',') p++;
+            else if (!lf) Error("\',\' expected, found: " + string(1, (char)max(Peek(), (int)' ')));
+        }
+        int n = (int)(elems.size() - start);
+        auto first = elems.data() + start;
 
-        lex.Next();
-    }
+        // a type name has to follow the ] directly, to tell it apart from a vector used as hashmap key
+        int type = V_VECTOR;
+        if (Peek() == ':' && (isalpha(Peek(1)) || Peek(1) == '_'))
+        {
+            p++;
+            ParseIdent();
+            if (sbuf == "hashmap")
+            {
+                if (n && !pairs) Error("hashmap requires key: value pairs");
+                auto hm = g_vm->NewHashMap(n / 2);
+                for (int i = 0; i < n; i += 2) hm->Set(first[i], first[i + 1]);
+                elems.resize(start);
+                return Value(hm);
+            }
+            if (pairs) Error("key: value pairs are only allowed in a hashmap");
+            if (sbuf == "pvector") type = V_PVECTOR;
+            size_t reqargs = 0;
+            int idx = type == V_PVECTOR ? -1 : g_vm->StructIdx(sbuf, reqargs);
+            if (idx >= 0)   // if unknown type, becomes regular vector
+            {
+                // drop elements if current type has less fields, pad with nil if it has more
+                while (n > (int)reqargs) elems[start + --n].DEC();
+                elems.resize(start + n);
+                while (n < (int)reqargs) { elems.push_back(Value(0, V_NIL)); n++; }
+                first = elems.data() + start;
+                type = idx;
+            }
+        }
+        if (pairs) Error("key: value pairs are only allowed in a hashmap");
 
-    void Gobble(TType t)
-    {
-        if (lex.token == t) lex.Next();
+        auto vec = g_vm->NewVector(n, type == V_PVECTOR ? V_VECTOR : type);
+        for (int i = 0; i < n; i++) vec->push(first[i]);
+        elems.resize(start);
+        if (type != V_PVECTOR) return Value(vec);
+        auto pv = g_vm->NewPVector();
+        pv->FromVector(vec);
+        Value(vec).DECRT();
+        return Value(pv);
     }
 };
 
-static Value ParseData(char *inp)
+static Value ParseData(ValueParser &parser)
 {
     try
     {
-        ValueParser parser(inp);
-        g_vm->Push(parser.Parse().INC());
+        g_vm->Push(parser.Parse());
         return Value(0, V_NIL);
     }
     catch (string &s)
@@ -152,19 +339,42 @@ void AddReaderOps()
 {
     STARTDECL(parse_data) (Value &ins)
     {
-        Value v = ParseData(ins.sval->str());
+        ValueParser parser(ins.sval->str(), ins.sval->len);
+        Value v = ParseData(parser);
         ins.DEC();
         return v;
     }
     ENDDECL1(parse_data, "stringdata", "S", "As",
         "parses a string containing a data structure in lobster syntax (what you get if you convert an arbitrary data"
-        " structure to a string) back into a data structure. supports int/float/string/vector and structs."
-        " structs will be forced to be compatible with their current definitions, i.e. too many elements will be"
-        " truncated, missing elements will be set to nil, and unknown type means downgrade to vector."
+        " structure to a string) back into a data structure. supports int/float/string/vector/hashmap/pvector and"
+        " structs. structs will be forced to be compatible with their current definitions, i.e. too many elements"
+        " will be truncated, missing elements will be set to nil, and unknown type means downgrade to vector."
         " useful for simple file formats. returns the value and an error string as second return value"
         " (or nil if no error)");
+
+    STARTDECL(parse_data_file) (Value &filename)
+    {
+        auto f = OpenForReading(filename.sval->str());
+        if (!f)
+        {
+            g_vm->Push(Value(0, V_NIL));
+            auto err = g_vm->NewString("can't open file: " + string(filename.sval->str()));
+            filename.DEC();
+            return Value(err);
+        }
+        Value v;
+        {
+            ValueParser parser(f, filename.sval->str());
+            v = ParseData(parser);
+        }
+        fclose(f);
+        filename.DEC();
+        return v;
+    }
+    ENDDECL1(parse_data_file, "filename", "S", "As",
+        "like parse_data(), but reads the data from a file a piece at a time, rather than requiring the whole file"
+        " to be loaded into a string first. returns the value and an error string as second return value"
+        " (or nil if no error)");
 }
 
 AutoRegister __aro("parsedata", AddReaderOps);
-
-
@@ -123,6 +123,11 @@ template<typename T> struct Typed
             case 'V': type.t = V_VECTOR; break;  // Deprecated, use ']'
             case 'C': type.t = V_FUNCTION; break;
             case 'R': type.t = V_COROUTINE; break;
+            case 'B': type.t = V_BUFFER; break;
+            case 'H': type.t = V_HASHMAP; break;
+            case 'Q': type.t = V_PQUEUE; break;
+            case 'T': type.t = V_STRINGBUILDER; break;
+            case 'P': type.t = V_PVECTOR; break;
             case 'A': type.t = V_ANY; break;
             default:  assert(0);
         }
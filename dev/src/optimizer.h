@@ -0,0 +1,455 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+namespace lobster
+{
+
+// AST level optimizer, runs between the TypeChecker and CodeGen.
+// Relies on exptype being set by the typechecker, so only typechecked code is touched.
+
+struct Optimizer
+{
+    Parser &parser;
+    SymbolTable &st;
+    bool verbose;
+
+    enum { MAX_INLINE_NODES = 16 };
+
+    // Number of nodes each transform removed (inlining may add nodes, so it counts calls as well).
+    int folded_removed, branches_removed, inline_removed, inlined_calls;
+
+    Optimizer(Parser &_p, SymbolTable &_st, bool _verbose)
+        : parser(_p), st(_st), verbose(_verbose),
+          folded_removed(0), branches_removed(0), inline_removed(0), inlined_calls(0)
+    {
+        OptimizeList(parser.root);
+
+        for (auto f : st.functiontable)
+            for (auto sf = f->subf; sf; sf = sf->next)
+                if (sf->typechecked && sf->body) OptimizeList(sf->body);
+
+        if (verbose)
+        {
+            printf("optimizer: constant folding removed %d nodes\n", folded_removed);
+            printf("optimizer: dead branch elimination removed %d nodes\n", branches_removed);
+            printf("optimizer: inlined %d calls, removing %d nodes\n", inlined_calls, inline_removed);
+        }
+    }
+
+    int CountNodes(const Node *n)
+    {
+        if (!n) return 0;
+        int c = 1;
+        if (n->HasChildren()) c += CountNodes(n->a()) + CountNodes(n->b());
+        return c;
+    }
+
+    // Replace n by r (which must not be part of n anymore), and free n.
+    // before is the size of n prior to detaching anything from it.
+    void Replace(Node *&n, Node *r, int &removed, int before)
+    {
+        delete n;
+        n = r;
+        removed += before - CountNodes(n);
+    }
+    void Replace(Node *&n, Node *r, int &removed) { Replace(n, r, removed, CountNodes(n)); }
+
+    Node *NewConst(const Node &orig, int i)
+    {
+        auto r = new Node(parser.lex, T_INT, i);
+        r->exptype = Type(V_INT);
+        r->linenumber = orig.linenumber;
+        r->fileidx = orig.fileidx;
+        return r;
+    }
+
+    Node *NewConst(const Node &orig, float f)
+    {
+        auto r = new Node(parser.lex, T_FLOAT, (double)f);
+        r->exptype = Type(V_FLOAT);
+        r->linenumber = orig.linenumber;
+        r->fileidx = orig.fileidx;
+        return r;
+    }
+
+    // Returns whether n is a constant with a known truth value, the same way the VM tests it.
+    bool ConstTruth(const Node *n, bool &truth)
+    {
+        switch (n->type)
+        {
+            case T_INT:   truth = n->integer() != 0; return true;
+            case T_FLOAT: { int2float i2f; i2f.f = (float)n->flt(); truth = i2f.i != 0; return true; }
+            case T_STR:   truth = true; return true;
+            case T_NIL:   truth = false; return true;
+            default:      return false;
+        }
+    }
+
+    void OptimizeList(Node *list)
+    {
+        for (; list; list = list->tail()) Optimize(list->head());
+    }
+
+    void Optimize(Node *&n)
+    {
+        if (!n) return;
+
+        switch (n->type)
+        {
+            case T_LIST:
+                OptimizeList(n);
+                return;
+
+            case T_FUN:          // Bodies are optimized individually from the function table.
+            case T_STRUCTDEF:
+                return;
+        }
+
+        if (n->HasChildren())
+        {
+            Optimize(n->a());
+            Optimize(n->b());
+        }
+
+        switch (n->type)
+        {
+            case T_PLUS:
+            case T_MINUS:
+            case T_MULT:
+            case T_DIV:
+            case T_MOD:
+            case T_LT:
+            case T_GT:
+            case T_LTEQ:
+            case T_GTEQ:
+            case T_EQ:
+            case T_NEQ:
+                FoldBinary(n);
+                break;
+
+            case T_UMINUS:
+            case T_NOT:
+            case T_I2F:
+                FoldUnary(n);
+                break;
+
+            case T_AND:
+            case T_OR:
+            {
+                // The result of these is the value of whichever side ends up deciding the outcome.
+                bool truth;
+                if (!ConstTruth(n->left(), truth)) break;
+                auto before = CountNodes(n);
+                Node *&keep = truth == (n->type == T_AND) ? n->right() : n->left();
+                auto r = keep;
+                keep = nullptr;
+                Replace(n, r, branches_removed, before);
+                break;
+            }
+
+            case T_IF:
+                ElimBranch(n);
+                break;
+
+            case T_CALL:
+                Inline(n, *n->call_function()->sf(), n->call_args());
+                break;
+
+            case T_DYNCALL:
+            {
+                // Statically known function values, usually function literals passed to a HOF (map, filter..)
+                // that got specialized by the typechecker.
+                auto sf = n->dcall_info()->dcall_function()->sf();
+                if (sf && !sf->parent->istype &&
+                    (n->dcall_fval()->type == T_IDENT || n->dcall_fval()->type == T_FUN))
+                    Inline(n, *sf, n->dcall_info()->dcall_args());
+                break;
+            }
+        }
+    }
+
+    void FoldBinary(Node *&n)
+    {
+        auto l = n->left(), r = n->right();
+        if (l->type == T_INT && r->type == T_INT)
+        {
+            int a = l->integer(), b = r->integer(), res;
+            switch (n->type)
+            {
+                case T_PLUS:  res = a + b; break;
+                case T_MINUS: res = a - b; break;
+                case T_MULT:  res = a * b; break;
+                case T_DIV:   if (!b) return; res = a / b; break;  // Leave division by zero to the VM.
+                case T_MOD:   if (!b) return; res = a % b; break;
+                case T_LT:    res = a <  b; break;
+                case T_GT:    res = a >  b; break;
+                case T_LTEQ:  res = a <= b; break;
+                case T_GTEQ:  res = a >= b; break;
+                case T_EQ:    res = a == b; break;
+                case T_NEQ:   res = a != b; break;
+                default:      return;
+            }
+            Replace(n, NewConst(*n, res), folded_removed);
+        }
+        else if (l->type == T_FLOAT && r->type == T_FLOAT)
+        {
+            // Compute in float, since that is what the VM will use.
+            float a = (float)l->flt(), b = (float)r->flt();
+            switch (n->type)
+            {
+                case T_PLUS:  Replace(n, NewConst(*n, a + b), folded_removed); break;
+                case T_MINUS: Replace(n, NewConst(*n, a - b), folded_removed); break;
+                case T_MULT:  Replace(n, NewConst(*n, a * b), folded_removed); break;
+                case T_DIV:   if (b != 0) Replace(n, NewConst(*n, a / b), folded_removed); break;
+                case T_LT:    Replace(n, NewConst(*n, int(a <  b)), folded_removed); break;
+                case T_GT:    Replace(n, NewConst(*n, int(a >  b)), folded_removed); break;
+                case T_LTEQ:  Replace(n, NewConst(*n, int(a <= b)), folded_removed); break;
+                case T_GTEQ:  Replace(n, NewConst(*n, int(a >= b)), folded_removed); break;
+                case T_EQ:    Replace(n, NewConst(*n, int(a == b)), folded_removed); break;
+                case T_NEQ:   Replace(n, NewConst(*n, int(a != b)), folded_removed); break;
+                default:      break;  // No float modulo in the VM.
+            }
+        }
+    }
+
+    void FoldUnary(Node *&n)
+    {
+        auto c = n->child();
+        switch (n->type)
+        {
+            case T_UMINUS:
+                if      (c->type == T_INT)   Replace(n, NewConst(*n, -c->integer()), folded_removed);
+                else if (c->type == T_FLOAT) Replace(n, NewConst(*n, -(float)c->flt()), folded_removed);
+                break;
+
+            case T_NOT:
+            {
+                bool truth;
+                if (ConstTruth(c, truth)) Replace(n, NewConst(*n, int(!truth)), folded_removed);
+                break;
+            }
+
+            case T_I2F:
+                if (c->type == T_INT) Replace(n, NewConst(*n, (float)c->integer()), folded_removed);
+                break;
+        }
+    }
+
+    void ElimBranch(Node *&n)
+    {
+        bool truth;
+        if (!ConstTruth(n->if_condition(), truth)) return;
+        bool has_else = n->if_branches()->right()->type != T_NIL;
+        auto before = CountNodes(n);
+
+        Node *r = nullptr;
+        if (truth || has_else)
+        {
+            // Call the surviving branch directly, which codegen turns into a static call if it can.
+            Node *&branch = truth ? n->if_branches()->left() : n->if_branches()->right();
+            auto sf = branch->type == T_FUN ? branch->sf() : nullptr;
+            r = new Node(parser.lex, T_DYNCALL, branch,
+                                     new Node(parser.lex, T_DYNINFO,
+                                         new Node(parser.lex, sf),
+                                         nullptr));
+            r->exptype = n->exptype;
+            r->linenumber = n->linenumber;
+            r->fileidx = n->fileidx;
+            branch = nullptr;
+        }
+        else
+        {
+            // No else, condition false: the value of an if is the condition.
+            r = n->if_condition();
+            n->if_condition() = nullptr;
+        }
+        Replace(n, r, branches_removed, before);
+        if (r->type == T_DYNCALL) Optimize(n);
+    }
+
+    // Only leaf functions consisting of a single expression without side effects on variables qualify.
+    // Being leaves (no calls to lobster functions), they are trivially non-recursive.
+    bool CanInline(const Node *n, int &size, bool &hasnatcall)
+    {
+        if (!n) return true;
+        if (++size > MAX_INLINE_NODES) return false;
+        switch (n->type)
+        {
+            case T_ASSIGN:
+            case T_DYNASSIGN:
+            case T_LOGASSIGN:
+            case T_PLUSEQ:
+            case T_MINUSEQ:
+            case T_MULTEQ:
+            case T_DIVEQ:
+            case T_MODEQ:
+            case T_INCR:
+            case T_DECR:
+            case T_POSTINCR:
+            case T_POSTDECR:
+            case T_DEF:
+            case T_ASSIGNLIST:
+            case T_RETURN:
+            case T_MULTIRET:
+            case T_CALL:
+            case T_DYNCALL:
+            case T_FUN:
+            case T_COCLOSURE:
+            case T_COROUTINE:
+            case T_CO_AT:
+            case T_STRUCTDEF:
+            case T_IF:
+            case T_WHILE:
+            case T_FOR:
+            case T_SUPER:
+                return false;
+
+            case T_NATCALL:
+                if (n->ncall_id()->nf()->ncm == NCM_CONT_EXIT) return false;
+                hasnatcall = true;
+                break;
+        }
+        return !n->HasChildren() || (CanInline(n->a(), size, hasnatcall) && CanInline(n->b(), size, hasnatcall));
+    }
+
+    int CountUses(const Node *n, const Ident *id)
+    {
+        if (!n) return 0;
+        if (n->type == T_IDENT) return n->ident() == id;
+        if (!n->HasChildren()) return 0;
+        return CountUses(n->a(), id) + CountUses(n->b(), id);
+    }
+
+    bool ConstArg(const Node *n)
+    {
+        switch (n->type)
+        {
+            case T_INT:
+            case T_FLOAT:
+            case T_STR:
+            case T_NIL:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    bool SimpleArg(const Node *n) { return ConstArg(n) || n->type == T_IDENT; }
+
+    // Wether id is used inside the right side of a & or |, i.e. where it may not get evaluated at all.
+    bool UsedConditionally(const Node *n, const Ident *id)
+    {
+        if (!n || !n->HasChildren()) return false;
+        if ((n->type == T_AND || n->type == T_OR) && CountUses(n->b(), id)) return true;
+        return UsedConditionally(n->a(), id) || UsedConditionally(n->b(), id);
+    }
+
+    // Wether n reads any variable other than the function's args.
+    bool ReadsOtherVars(const Node *n, const SubFunction &sf)
+    {
+        if (!n) return false;
+        if (n->type == T_IDENT)
+        {
+            for (auto &arg : sf.args.v) if (n->ident() == arg.id) return false;
+            return true;
+        }
+        return n->HasChildren() && (ReadsOtherVars(n->a(), sf) || ReadsOtherVars(n->b(), sf));
+    }
+
+    // Wether a native call in n gets a value that may be a function, which it could call, and which could then
+    // modify any variable.
+    bool MayCallBack(const Node *n)
+    {
+        if (!n || !n->HasChildren()) return false;
+        if (n->type == T_NATCALL)
+            for (auto list = n->ncall_args(); list; list = list->tail())
+                if (list->head()->exptype.t == V_FUNCTION || list->head()->exptype.t == V_ANY) return true;
+        return MayCallBack(n->a()) || MayCallBack(n->b());
+    }
+
+    // Replaces uses of function args with the call's arg expressions.
+    void Substitute(Node *&n, vector<pair<Ident *, Node **>> &subst)
+    {
+        if (!n) return;
+        if (n->type == T_IDENT)
+        {
+            for (auto &s : subst) if (n->ident() == s.first)
+            {
+                auto &arg = *s.second;
+                Node *r;
+                if (SimpleArg(arg)) r = arg->Clone();
+                else { r = arg; arg = nullptr; }  // Used exactly once, so move it out of the call.
+                delete n;
+                n = r;
+                return;
+            }
+        }
+        else if (n->HasChildren())
+        {
+            Substitute(n->a(), subst);
+            Substitute(n->b(), subst);
+        }
+    }
+
+    void Inline(Node *&n, SubFunction &sf, Node *args)
+    {
+        auto &f = *sf.parent;
+        if (f.multimethod || f.istype || !sf.typechecked) return;
+        if (!sf.body || sf.body->tail() || sf.locals.v.size() || sf.returntypes.size() != 1) return;
+
+        int size = 0;
+        bool hasnatcall = false;
+        if (!CanInline(sf.body->head(), size, hasnatcall)) return;
+
+        // Check the args can be substituted without changing evaluation order, or skipping runtime type checks.
+        // Excess args to dynamic calls are never evaluated, so can be ignored.
+        // Substitution moves the evaluation of each arg to where it is used in the body, so:
+        // - a variable arg must not be modified by anything evaluated before its use: another arg or a callback.
+        // - a complex arg (at most one) must be used exactly once and unconditionally, and not be moved past
+        //   anything its side effects could affect: other variable args, reads of other variables, native calls.
+        auto body = sf.body->head();
+        vector<pair<Ident *, Node **>> subst;
+        int ncomplex = 0, nvars = 0;
+        auto list = args;
+        for (auto &arg : sf.args.v)
+        {
+            if (!list) return;
+            auto a = list->head();
+            if (arg.type.t != V_ANY && a->exptype != arg.type) return;
+            if (a->type == T_IDENT) nvars++;
+            else if (!ConstArg(a))
+            {
+                if (hasnatcall || ncomplex++ || CountUses(body, arg.id) != 1 || UsedConditionally(body, arg.id))
+                    return;
+            }
+            subst.push_back(make_pair(arg.id, &list->head()));
+            list = list->tail();
+        }
+        if (ncomplex && (nvars || ReadsOtherVars(body, sf))) return;
+        if (nvars && MayCallBack(body)) return;
+
+        auto before = CountNodes(n);
+        auto r = body->Clone();
+        Substitute(r, subst);
+        r->linenumber = n->linenumber;
+        r->fileidx = n->fileidx;
+        Replace(n, r, inline_removed, before);
+        inlined_calls++;
+
+        // The substituted args may have enabled further folding.
+        Optimize(n);
+    }
+};
+
+}  // namespace lobster
@@ -0,0 +1,99 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+using namespace lobster;
+
+// parallel_map() runs its function in a VM per thread, each sharing the program of the calling VM and starting out
+// with a copy of its variables. VMs don't share heaps, so elements and results travel serialized.
+// The parser checks that the function doesn't use outside variables that are ever assigned to, since those
+// assignments would only ever affect one of the copies (see Parser::CheckParallelFuns).
+
+void AddParallel()
+{
+    STARTDECL(parallel_map) (Value &xs, Value &fn)
+    {
+        auto parent = g_vm;
+        int n = xs.vval->len;
+        vector<string> ins(n), outs(n);
+        try
+        {
+            for (int i = 0; i < n; i++) ins[i] = SerializeValue(xs.vval->at(i));
+        }
+        catch (string &s)
+        {
+            xs.DEC();
+            return g_vm->BuiltinError("parallel_map: " + s);
+        }
+        xs.DEC();
+
+        vector<VarSnapshot> snap;
+        parent->SnapshotVars(snap);
+
+        int nthreads = min(n, max(1, (int)thread::hardware_concurrency()));
+        // seeded from the calling VM, so workers don't all produce the same random numbers
+        vector<int> seeds(nthreads);
+        for (auto &seed : seeds) seed = parent->rnd(0x7FFFFFFF);
+
+        atomic<int> next(0);
+        mutex errmtx;
+        string err;
+        vector<thread> workers;
+        for (int t = 0; t < nthreads; t++) workers.push_back(thread([&, t]()
+        {
+            try
+            {
+                parent->RunWorker(snap, [&]()
+                {
+                    g_vm->rnd.seed(seeds[t]);
+                    for (int i; (i = next++) < n; )
+                    {
+                        g_vm->Push(DeserializeValue(ins[i]));
+                        auto r = g_vm->EvalC(fn, 1);
+                        outs[i] = SerializeValue(r);
+                        r.DEC();
+                    }
+                });
+            }
+            catch (string &s)
+            {
+                next = n;   // stop the other workers
+                lock_guard<mutex> lock(errmtx);
+                if (err.empty()) err = s;
+            }
+        }));
+        for (auto &w : workers) w.join();
+        if (!err.empty()) return g_vm->BuiltinError("parallel_map: " + err);
+
+        auto res = g_vm->NewVector(n, V_VECTOR);
+        for (int i = 0; i < n; i++) res->push(DeserializeValue(outs[i]));
+        return Value(res);
+    }
+    ENDDECL2(parallel_map, "xs,fun", "VC", "V",
+        "like map(), but calls fun(x) for all elements of xs on as many threads as there are cores, and returns a"
+        " vector of the results in order. fun must be a function literal, and may not use variables from outside of"
+        " it that are assigned to (other than at their definition), since each thread works on copies of all"
+        " variables. elements and results are copied between threads (as if by serialize()), so may only contain"
+        " data, not coroutines.");
+}
+
+AutoRegister __apar("parallel", AddParallel);
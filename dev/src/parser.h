@@ -28,6 +28,8 @@ struct Parser
     struct ForwardFunctionCall { string idname; size_t maxscopelevel; Node *n; };
     vector<ForwardFunctionCall> forwardfunctioncalls;
 
+    vector<Node *> parallelfuns;    // function args to parallel_map(), checked once all assignments are known
+
     Parser(const char *_src, SymbolTable &_st, char *_stringsource)
         : lex(_src, _st.filenames, _stringsource), root(nullptr), st(_st), currentstruct(nullptr)
     {
@@ -60,6 +62,21 @@ struct Parser
         Expect(T_ENDOFFILE);
 
         assert(forwardfunctioncalls.empty());
+
+        CheckParallelFuns();
+    }
+
+    // parallel_map() runs its function on other threads, each with its own copy of all variables, so any
+    // assignment to a variable it uses from outside would not be seen by the rest of the program (or it would
+    // see a stale value). Such variables must be assigned only once, at their definition.
+    // This doesn't catch modifying the contents of vectors, or functions called from it assigning variables.
+    void CheckParallelFuns()
+    {
+        for (auto fun : parallelfuns)
+            for (auto &fv : fun->sf()->freevars.v)
+                if (!fv.id->single_assignment)
+                    Error("parallel_map() function must not use variable " + fv.id->name +
+                          " from outside of it, since it is assigned to", fun);
     }
 
     void AddTail(Node **&tail, Node *a)
@@ -906,6 +923,13 @@ struct Parser
             {
                 return new Node(lex, T_FOR, args->head(), MaxClosureArgCheck(args->tail()->head(), 2));
             }
+            else if (nf->name == "parallel_map")
+            {
+                auto fun = args->tail()->head();
+                if (fun->type != T_FUN || !fun->sf())
+                    Error("parallel_map() requires a function literal as second argument", fun);
+                parallelfuns.push_back(fun);
+            }
 
             return new Node(lex, T_NATCALL, new Node(lex, nf), args);
         }
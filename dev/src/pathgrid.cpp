@@ -0,0 +1,191 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+#include <mutex>
+#include <memory>
+
+using namespace lobster;
+
+// A* over a flat grid of per cell costs. All per cell state lives in arrays that are kept between calls, and are
+// invalidated by bumping a generation counter rather than clearing them, so a query only costs what it visits.
+// VMs on other threads may search at the same time, so each call takes a set of arrays from a pool.
+
+struct PathNode
+{
+    float f, g;
+    int cell;
+
+    // heap ordering: lowest f first, on equal f prefer the node furthest along
+    bool operator<(const PathNode &o) const { return f > o.f || (f == o.f && g < o.g); }
+};
+
+struct PathScratch
+{
+    vector<float> g;
+    vector<int> parent;
+    vector<uint> opengen, closedgen;
+    vector<PathNode> heap;
+    uint gen;
+
+    PathScratch() : gen(0) {}
+
+    void Start(int cells)
+    {
+        if ((int)g.size() < cells)
+        {
+            g.resize(cells);
+            parent.resize(cells);
+            opengen.resize(cells, 0);
+            closedgen.resize(cells, 0);
+        }
+        if (!++gen)
+        {
+            // wrapped around, old stamps could now look current
+            fill(opengen.begin(), opengen.end(), 0);
+            fill(closedgen.begin(), closedgen.end(), 0);
+            gen = 1;
+        }
+        heap.clear();
+    }
+};
+
+static mutex scratchmtx;
+static vector<unique_ptr<PathScratch>> scratchpool;
+
+struct ScratchLease
+{
+    unique_ptr<PathScratch> s;
+
+    ScratchLease()
+    {
+        lock_guard<mutex> lock(scratchmtx);
+        if (scratchpool.empty()) { s.reset(new PathScratch()); return; }
+        s = move(scratchpool.back());
+        scratchpool.pop_back();
+    }
+
+    ~ScratchLease()
+    {
+        lock_guard<mutex> lock(scratchmtx);
+        scratchpool.push_back(move(s));
+    }
+};
+
+template<typename T> bool FindPath(PathScratch &s, const T *costs, int w, int h, int2 start, int2 goal,
+                                   bool diagonal)
+{
+    static const int dx[] = { -1, 1, 0, 0, -1, 1, 1, -1 };
+    static const int dy[] = { 0, 0, -1, 1, -1, 1, -1, 1 };
+    const float SQRT2 = 1.41421356f;
+
+    auto heuristic = [&](int x, int y) -> float
+    {
+        int ax = abs(x - goal.x()), ay = abs(y - goal.y());
+        return diagonal ? max(ax, ay) + (SQRT2 - 1) * min(ax, ay) : (float)(ax + ay);
+    };
+
+    int sc = start.x() + start.y() * w, gc = goal.x() + goal.y() * w;
+    if (costs[gc] <= 0) return false;
+
+    s.Start(w * h);
+    s.g[sc] = 0;
+    s.parent[sc] = -1;
+    s.opengen[sc] = s.gen;
+    PathNode sn = { heuristic(start.x(), start.y()), 0, sc };
+    s.heap.push_back(sn);
+
+    while (!s.heap.empty())
+    {
+        auto n = s.heap.front();
+        pop_heap(s.heap.begin(), s.heap.end());
+        s.heap.pop_back();
+        // nodes get pushed again when their cost improves, skip the stale entries
+        if (s.closedgen[n.cell] == s.gen || n.g > s.g[n.cell]) continue;
+        if (n.cell == gc) return true;
+        s.closedgen[n.cell] = s.gen;
+
+        int x = n.cell % w, y = n.cell / w;
+        for (int d = 0; d < (diagonal ? 8 : 4); d++)
+        {
+            int nx = x + dx[d], ny = y + dy[d];
+            if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+            int nc = nx + ny * w;
+            float cost = (float)costs[nc];
+            if (cost <= 0 || s.closedgen[nc] == s.gen) continue;
+            if (d >= 4)
+            {
+                // don't cut corners
+                if (costs[nx + y * w] <= 0 || costs[x + ny * w] <= 0) continue;
+                cost *= SQRT2;
+            }
+            float g = n.g + cost;
+            if (s.opengen[nc] == s.gen && g >= s.g[nc]) continue;
+            s.opengen[nc] = s.gen;
+            s.g[nc] = g;
+            s.parent[nc] = n.cell;
+            PathNode nn = { g + heuristic(nx, ny), g, nc };
+            s.heap.push_back(nn);
+            push_heap(s.heap.begin(), s.heap.end());
+        }
+    }
+    return false;
+}
+
+void AddPathGrid()
+{
+    STARTDECL(path_grid) (Value &grid, Value &width, Value &start, Value &goal, Value &diagonal)
+    {
+        auto buf = grid.bval;
+        int w = width.ival;
+        auto sp = ValueDecTo<int2>(start);
+        auto gp = ValueDecTo<int2>(goal);
+        if (w <= 0 || buf->len % w)
+            g_vm->BuiltinError("path_grid: buffer length must be a multiple of the width");
+        int h = buf->len / w;
+        auto inside = [&](const int2 &p) { return p.x() >= 0 && p.y() >= 0 && p.x() < w && p.y() < h; };
+        if (!inside(sp) || !inside(gp))
+            g_vm->BuiltinError("path_grid: start or goal outside of the grid");
+
+        ScratchLease lease;
+        auto &s = *lease.s;
+        bool found = false;
+        switch (buf->elemtype)
+        {
+            case BE_FLOAT: found = FindPath(s, buf->fdata(), w, h, sp, gp, diagonal.True()); break;
+            case BE_INT:   found = FindPath(s, buf->idata(), w, h, sp, gp, diagonal.True()); break;
+            default:       found = FindPath(s, buf->bdata(), w, h, sp, gp, diagonal.True()); break;
+        }
+        grid.DECRT();
+
+        vector<int> cells;
+        if (found) for (int c = gp.x() + gp.y() * w; c >= 0; c = s.parent[c]) cells.push_back(c);
+        auto path = g_vm->NewVector((int)cells.size(), V_VECTOR);
+        for (auto it = cells.rbegin(); it != cells.rend(); ++it) path->push(ToValue(int2(*it % w, *it / w)));
+        return Value(path);
+    }
+    ENDDECL5(path_grid, "grid,width,start,goal,diagonal", "BIVVi", "V",
+        "finds the cheapest path on a grid of width cells wide, stored row by row in a buffer (any element type)."
+        " each cell holds the cost of entering it, or 0 (or less) if it is blocked. costs should be at least 1 for"
+        " the path to be guaranteed optimal. moves in 4 directions, or 8 if diagonal is true (costing sqrt(2) times"
+        " more, and not cutting corners of blocked cells). returns the path as a vector of xy from start to goal"
+        " inclusive, or an empty vector if there is none.");
+}
+
+AutoRegister __apg("pathgrid", AddPathGrid);
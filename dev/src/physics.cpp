@@ -173,19 +173,22 @@ void AddPhysicsOps()
 	{
 		auto &body = GetBody(other_id, position);
 		b2PolygonShape shape;
-		auto verts = new b2Vec2[vertices.vval->len];
-    for (int i = 0; i < vertices.vval->len; i++)
+		CheckVectorOrBuffer(vertices, "ph_createpolygon");
+		int nverts = ValueElemCount(vertices, 2);
+		auto verts = new b2Vec2[nverts];
+    for (int i = 0; i < nverts; i++)
     {
-        auto vert = ValueTo<float2>(vertices.vval->at(i));
+        auto vert = ValueElemTo<float2>(vertices, i, 2);
         verts[i] = *(b2Vec2 *)&vert;
     }
-		shape.Set(verts, vertices.vval->len);
+		shape.Set(verts, nverts);
 		delete[] verts;
 		vertices.DECRT();
 		return CreateFixture(body, shape);
 	}
-	ENDDECL3(ph_createpolygon, "position,vertices,attachto", "VVi", "I",
-        "creates a polygon circle shape in the world at position, with the given list of vertices."
+	ENDDECL3(ph_createpolygon, "position,vertices,attachto", "VAi", "I",
+        "creates a polygon circle shape in the world at position, with the given list of vertices"
+        " (a vector of xy vectors, or a float buffer with 2 floats per vertex)."
         " attachto is a previous physical object to attach this one to, to become a combined physical body.");
 
 	STARTDECL(ph_dynamic) (Value &fixture_id, Value &on)
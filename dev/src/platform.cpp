@@ -186,6 +186,16 @@ uchar *LoadFile(const char *relfilename, size_t *lenret)
     return LoadFilePlatform((writedir + srfn).c_str(), lenret);
 }
 
+// searches the same folders as LoadFile, for reading a file piece by piece. always binary
+FILE *OpenForReading(const char *relfilename)
+{
+    auto srfn = SanitizePath(relfilename);
+    auto f = fopen((datadir + srfn).c_str(), "rb");
+    if (!f) f = fopen((auxdir + srfn).c_str(), "rb");
+    if (!f) f = fopen((writedir + srfn).c_str(), "rb");
+    return f;
+}
+
 FILE *OpenForWriting(const char *relfilename, bool binary)
 {
     return fopen((writedir + SanitizePath(relfilename)).c_str(), binary ? "wb" : "w");
@@ -21,6 +21,7 @@ extern string StripDirPart(const char *filepath);
 extern bool SetupDefaultDirs(const char *exefilepath, const char *auxfilepath, bool from_bundle);
 
 extern uchar *LoadFile(const char *relfilename, size_t *len = nullptr);
+extern FILE *OpenForReading(const char *relfilename);
 extern FILE *OpenForWriting(const char *relfilename, bool binary);
 extern string SanitizePath(const char *path);
 
@@ -0,0 +1,101 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+using namespace lobster;
+
+static LPQueue *CheckHandle(Value &q, Value &handle, const char *name)
+{
+    auto pq = q.qval;
+    if (!pq->Contains(handle.ival))
+        g_vm->BuiltinError(string(name) + ": handle " + inttoa(handle.ival) + " is not in the queue");
+    return pq;
+}
+
+void AddPQueue()
+{
+    STARTDECL(pqueue) ()
+    {
+        return Value(g_vm->NewPQueue());
+    }
+    ENDDECL0(pqueue, "", "", "Q",
+        "creates a new empty priority queue, which returns items lowest priority first");
+
+    STARTDECL(pqueue_push) (Value &q, Value &item, Value &pri, Value &pri2)
+    {
+        int handle = q.qval->Push(item, pri.fval, pri2.type == V_FLOAT ? pri2.fval : 0);
+        q.DECRT();
+        return Value(handle);
+    }
+    ENDDECL4(pqueue_push, "queue,item,priority,tiebreak", "QAFf", "I",
+        "adds item to the queue, and returns a handle that can be used with pqueue_update()/pqueue_remove() while"
+        " the item is in the queue. items with equal priority are ordered by tiebreak (lowest first), and then in"
+        " the order they were pushed.");
+
+    STARTDECL(pqueue_update) (Value &q, Value &handle, Value &pri, Value &pri2)
+    {
+        CheckHandle(q, handle, "pqueue_update")->Update(handle.ival, pri.fval, pri2.type == V_FLOAT ? pri2.fval : 0);
+        return q;
+    }
+    ENDDECL4(pqueue_update, "queue,handle,priority,tiebreak", "QIFf", "Q",
+        "changes the priority of an item in the queue (in O(log n)), its place among items of equal priority"
+        " is kept. returns the queue.");
+
+    STARTDECL(pqueue_pop) (Value &q)
+    {
+        auto pq = q.qval;
+        Value item(0, V_NIL);
+        if (pq->size()) item = pq->Remove(pq->heap[0].handle);
+        q.DECRT();
+        return item;
+    }
+    ENDDECL1(pqueue_pop, "queue", "Q", "A",
+        "removes the item with the lowest priority from the queue and returns it, or nil if the queue is empty");
+
+    STARTDECL(pqueue_top) (Value &q)
+    {
+        auto pq = q.qval;
+        Value item = pq->size() ? pq->heap[0].item.INC() : Value(0, V_NIL);
+        q.DECRT();
+        return item;
+    }
+    ENDDECL1(pqueue_top, "queue", "Q", "A",
+        "returns the item with the lowest priority without removing it, or nil if the queue is empty");
+
+    STARTDECL(pqueue_remove) (Value &q, Value &handle)
+    {
+        auto item = CheckHandle(q, handle, "pqueue_remove")->Remove(handle.ival);
+        q.DECRT();
+        return item;
+    }
+    ENDDECL2(pqueue_remove, "queue,handle", "QI", "A",
+        "removes the item with the given handle from the queue, and returns it");
+
+    STARTDECL(pqueue_contains) (Value &q, Value &handle)
+    {
+        bool has = q.qval->Contains(handle.ival);
+        q.DECRT();
+        return Value(has);
+    }
+    ENDDECL2(pqueue_contains, "queue,handle", "QI", "I",
+        "returns wether the handle refers to an item that is still in the queue. note that handles get reused"
+        " after their item leaves the queue.");
+}
+
+AutoRegister __apq("pqueue", AddPQueue);
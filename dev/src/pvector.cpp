@@ -0,0 +1,95 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+using namespace lobster;
+
+static void CheckIndex(Value &pv, Value &i, const char *name)
+{
+    if (i.ival < 0 || i.ival >= pv.pvval->len)
+        g_vm->BuiltinError(string(name) + ": index " + inttoa(i.ival) + " out of range");
+}
+
+void AddPVector()
+{
+    STARTDECL(pvector) (Value &xs)
+    {
+        auto pv = g_vm->NewPVector();
+        if (xs.type == V_VECTOR)
+        {
+            pv->FromVector(xs.vval);
+            xs.DECRT();
+        }
+        return Value(pv);
+    }
+    ENDDECL1(pvector, "xs", "v", "P",
+        "creates a persistent vector with the elements of xs, or an empty one. a persistent vector is never"
+        " modified: pvector_set/pvector_push/pvector_pop return a new version in O(log n) that shares most of"
+        " its memory with the old one, so keeping many versions around (e.g. for undo) is cheap.");
+
+    STARTDECL(pvector_get) (Value &pv, Value &i)
+    {
+        CheckIndex(pv, i, "pvector_get");
+        auto v = pv.pvval->at(i.ival).INC();
+        pv.DECRT();
+        return v;
+    }
+    ENDDECL2(pvector_get, "pv,i", "PI", "A",
+        "returns the element at index i");
+
+    STARTDECL(pvector_set) (Value &pv, Value &i, Value &x)
+    {
+        CheckIndex(pv, i, "pvector_set");
+        auto npv = pv.pvval->Set(i.ival, x);
+        pv.DECRT();
+        return Value(npv);
+    }
+    ENDDECL3(pvector_set, "pv,i,x", "PIA", "P",
+        "returns a new version of pv with the element at index i replaced by x (assoc)");
+
+    STARTDECL(pvector_push) (Value &pv, Value &x)
+    {
+        auto npv = pv.pvval->Push(x);
+        pv.DECRT();
+        return Value(npv);
+    }
+    ENDDECL2(pvector_push, "pv,x", "PA", "P",
+        "returns a new version of pv with x added to the end");
+
+    STARTDECL(pvector_pop) (Value &pv)
+    {
+        if (!pv.pvval->len) g_vm->BuiltinError("pvector_pop: empty pvector");
+        auto npv = pv.pvval->Pop();
+        pv.DECRT();
+        return Value(npv);
+    }
+    ENDDECL1(pvector_pop, "pv", "P", "P",
+        "returns a new version of pv without its last element (get that first with pvector_get if needed)");
+
+    STARTDECL(pvector_to_vector) (Value &pv)
+    {
+        auto vec = g_vm->NewVector(pv.pvval->len, V_VECTOR);
+        pv.pvval->ForEach([&](const Value &v) { vec->push(Value(v).INC()); });
+        pv.DECRT();
+        return Value(vec);
+    }
+    ENDDECL1(pvector_to_vector, "pv", "P", "V",
+        "returns a regular vector with the elements of pv");
+}
+
+AutoRegister __apv("pvector", AddPVector);
@@ -0,0 +1,417 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+using namespace lobster;
+
+// Binary format written by serialize(), read by deserialize():
+//
+// header:  "LB", format version byte, flags byte (SER_SHARED)
+//          varint number of struct names, each a varint length followed by the characters
+// value:   a tag byte, followed by:
+//          ST_NIL:     -
+//          ST_INT:     zigzag varint
+//          ST_FLOAT:   4 bytes raw float bits (little endian)
+//          ST_STRING:  varint length, characters
+//          ST_VECTOR:  varint length, values
+//          ST_STRUCT:  varint index into the struct name table, varint length, values
+//          ST_HASHMAP: varint count, key/value pairs
+//          ST_BUFFER:  element type byte, varint length, raw elements
+//          ST_PVECTOR: varint length, values
+//          ST_REF:     varint index of an earlier object (SER_SHARED only)
+//
+// With SER_SHARED, every string/vector/hashmap/buffer/pvector gets an index in the order it is first written, and
+// further references to it are written as ST_REF, so sharing (and cycles) survive the round trip.
+
+enum { SER_VERSION = 1, SER_SHARED = 1 };
+enum { ST_NIL, ST_INT, ST_FLOAT, ST_STRING, ST_VECTOR, ST_STRUCT, ST_HASHMAP, ST_BUFFER, ST_PVECTOR, ST_REF };
+
+struct ValueWriter
+{
+    string out;
+    string header;
+    bool shared;
+    map<RefObj *, int> objs;
+    map<int, int> structidx;  // struct type -> index in the name table
+    int depth;
+
+    ValueWriter(bool _shared) : shared(_shared), depth(0) {}
+
+    void Byte(int b) { out.push_back((char)b); }
+
+    void VarInt(uint u, string &s)
+    {
+        while (u >= 0x80) { s.push_back((char)(u | 0x80)); u >>= 7; }
+        s.push_back((char)u);
+    }
+
+    void VarInt(uint u) { VarInt(u, out); }
+
+    void Bytes(const void *p, size_t len) { out.append((const char *)p, len); }
+
+    // returns true if ref was written already, and writes an ST_REF to it
+    bool Seen(RefObj *ref)
+    {
+        if (!shared) return false;
+        auto it = objs.find(ref);
+        if (it == objs.end())
+        {
+            int idx = (int)objs.size();
+            objs[ref] = idx;
+            return false;
+        }
+        Byte(ST_REF);
+        VarInt(it->second);
+        return true;
+    }
+
+    void Write(const Value &v)
+    {
+        switch (v.type)
+        {
+            case V_NIL:   Byte(ST_NIL); break;
+            case V_INT:   Byte(ST_INT); VarInt(((uint)v.ival << 1) ^ (uint)(v.ival >> 31)); break;
+            case V_FLOAT: Byte(ST_FLOAT); Bytes(&v.fval, sizeof(float)); break;
+
+            case V_STRING:
+                if (Seen(v.ref)) break;
+                Byte(ST_STRING);
+                VarInt(v.sval->len);
+                Bytes(v.sval->str(), v.sval->len);
+                break;
+
+            case V_VECTOR:
+            {
+                if (Seen(v.ref)) break;
+                auto vec = v.vval;
+                if (vec->type >= 0)
+                {
+                    auto it = structidx.find(vec->type);
+                    int idx = (int)structidx.size();
+                    if (it == structidx.end()) structidx[vec->type] = idx;
+                    else idx = it->second;
+                    Byte(ST_STRUCT);
+                    VarInt(idx);
+                }
+                else Byte(ST_VECTOR);
+                VarInt(vec->len);
+                Nested([&]() { for (int i = 0; i < vec->len; i++) Write(vec->at(i)); });
+                break;
+            }
+
+            case V_HASHMAP:
+            {
+                if (Seen(v.ref)) break;
+                auto hm = v.hval;
+                Byte(ST_HASHMAP);
+                VarInt(hm->len);
+                Nested([&]()
+                {
+                    for (int i = 0; i < hm->cap; i++) if (hm->slots[i].hash > LHashMap::TOMBSTONE)
+                    {
+                        Write(hm->slots[i].key);
+                        Write(hm->slots[i].val);
+                    }
+                });
+                break;
+            }
+
+            case V_BUFFER:
+                if (Seen(v.ref)) break;
+                Byte(ST_BUFFER);
+                Byte(v.bval->elemtype);
+                VarInt(v.bval->len);
+                Bytes(v.bval->bdata(), v.bval->bytes());
+                break;
+
+            case V_PVECTOR:
+                if (Seen(v.ref)) break;
+                Byte(ST_PVECTOR);
+                VarInt(v.pvval->len);
+                Nested([&]() { v.pvval->ForEach([&](const Value &e) { Write(e); }); });
+                break;
+
+            default:
+                throw string("cannot serialize values of type ") + g_vm->ProperTypeName(v);
+        }
+    }
+
+    template<typename F> void Nested(F f)
+    {
+        // without SER_SHARED a cyclic structure would recurse forever
+        if (++depth > 10000) throw string("data structure too deeply nested (cyclic?)");
+        f();
+        depth--;
+    }
+
+    string Finish()
+    {
+        vector<int> types(structidx.size());
+        for (auto &p : structidx) types[p.second] = p.first;
+        header = "LB";
+        header.push_back((char)SER_VERSION);
+        header.push_back((char)(shared ? SER_SHARED : 0));
+        VarInt((uint)types.size(), header);
+        for (auto t : types)
+        {
+            auto &name = g_vm->ReverseLookupType(t);
+            VarInt((uint)name.size(), header);
+            header += name;
+        }
+        return header + out;
+    }
+};
+
+struct ValueReader
+{
+    const uchar *p, *end;
+    bool shared;
+    vector<RefObj *> allocated;     // everything we created, each holding a reference dropped by ~ValueReader
+    vector<RefObj *> objs;          // in SER_SHARED order
+    struct StructInfo { int idx; size_t nargs; };
+    vector<StructInfo> structs;
+    int depth;
+
+    ValueReader(const uchar *_p, size_t len) : p(_p), end(_p + len), shared(false), depth(0) {}
+
+    ~ValueReader()
+    {
+        for (auto lo : allocated) Value(lo).DECRT();
+    }
+
+    void Error(const char *what) { throw string("deserialize: ") + what; }
+
+    void Need(size_t n) { if ((size_t)(end - p) < n) Error("unexpected end of data"); }
+
+    int Byte() { Need(1); return *p++; }
+
+    uint VarInt()
+    {
+        uint u = 0;
+        for (int shift = 0; ; shift += 7)
+        {
+            if (shift > 28) Error("malformed varint");
+            int b = Byte();
+            u |= (uint)(b & 0x7F) << shift;
+            if (!(b & 0x80)) return u;
+        }
+    }
+
+    // a length of elements that each take up at least minsize bytes, so corrupt data can't make us allocate a lot
+    int Len(size_t minsize)
+    {
+        auto n = VarInt();
+        if (n > 0x7FFFFFFF || n > (size_t)(end - p) / minsize) Error("length out of range");
+        return (int)n;
+    }
+
+    template<typename T> T *Own(T *o)
+    {
+        allocated.push_back(o);
+        if (shared) objs.push_back(o);
+        return o;
+    }
+
+    Value Parse()
+    {
+        Need(4);
+        if (p[0] != 'L' || p[1] != 'B') Error("not serialized data");
+        if (p[2] != SER_VERSION) Error("unsupported format version");
+        shared = (p[3] & SER_SHARED) != 0;
+        p += 4;
+        int nstructs = Len(1);
+        for (int i = 0; i < nstructs; i++)
+        {
+            int len = Len(1);
+            string name((const char *)p, len);
+            p += len;
+            StructInfo si = { -1, 0 };
+            si.idx = g_vm->StructIdx(name, si.nargs);
+            structs.push_back(si);
+        }
+        auto v = Read();
+        if (p != end) Error("trailing data");
+        return v;
+    }
+
+    // the result is only owned by allocated (the caller INCs what it keeps), containers INC what they hold
+    Value Read()
+    {
+        switch (Byte())
+        {
+            case ST_NIL:   return Value(0, V_NIL);
+            case ST_INT:   { auto u = VarInt(); return Value((int)((u >> 1) ^ (0 - (u & 1)))); }
+            case ST_FLOAT: { Need(sizeof(float)); float f; memcpy(&f, p, sizeof(float)); p += sizeof(float);
+                             return Value(f); }
+
+            case ST_STRING:
+            {
+                int len = Len(1);
+                auto s = Own(g_vm->NewString((const char *)p, len));
+                p += len;
+                return Value(s);
+            }
+
+            case ST_VECTOR:
+            case ST_PVECTOR:
+            {
+                bool pvec = p[-1] == ST_PVECTOR;
+                int len = Len(1);
+                // for pvectors, a vector to build it from, so elements can refer back to the pvector
+                auto vec = pvec ? g_vm->NewVector(len, V_VECTOR) : Own(g_vm->NewVector(len, V_VECTOR));
+                auto pv = pvec ? Own(g_vm->NewPVector()) : nullptr;
+                if (pvec) allocated.push_back(vec);
+                Nested([&]() { for (int i = 0; i < len; i++) vec->push(Read().INC()); });
+                if (!pvec) return Value(vec);
+                pv->FromVector(vec);
+                return Value(pv);
+            }
+
+            case ST_STRUCT:
+            {
+                auto idx = VarInt();
+                if (idx >= structs.size()) Error("struct index out of range");
+                auto &si = structs[idx];
+                int len = Len(1);
+                // structs are made compatible with their current definition the same way parse_data does:
+                // extra fields are dropped, missing ones become nil, and an unknown type becomes a vector
+                int nlen = si.idx >= 0 ? (int)si.nargs : len;
+                auto vec = Own(g_vm->NewVector(max(len, nlen), si.idx >= 0 ? si.idx : V_VECTOR));
+                Nested([&]()
+                {
+                    for (int i = 0; i < len; i++)
+                    {
+                        auto e = Read();
+                        if (i < nlen) vec->push(e.INC());
+                    }
+                });
+                while (vec->len < nlen) vec->push(Value(0, V_NIL));
+                return Value(vec);
+            }
+
+            case ST_HASHMAP:
+            {
+                int len = Len(2);
+                auto hm = Own(g_vm->NewHashMap(len));
+                Nested([&]()
+                {
+                    for (int i = 0; i < len; i++)
+                    {
+                        auto key = Read();
+                        auto val = Read();
+                        hm->Set(key.INC(), val.INC());
+                    }
+                });
+                return Value(hm);
+            }
+
+            case ST_BUFFER:
+            {
+                int et = Byte();
+                if (et != BE_FLOAT && et != BE_INT && et != BE_BYTE) Error("unknown buffer element type");
+                int len = Len(LBuffer::ElemSize(et));
+                auto buf = Own(g_vm->NewBuffer(len, et));
+                memcpy(buf->bdata(), p, buf->bytes());
+                p += buf->bytes();
+                return Value(buf);
+            }
+
+            case ST_REF:
+            {
+                auto idx = VarInt();
+                if (idx >= objs.size()) Error("reference out of range");
+                return Value(objs[idx]);
+            }
+
+            default:
+                Error("unknown tag");
+                return Value();
+        }
+    }
+
+    template<typename F> void Nested(F f)
+    {
+        if (++depth > 10000) Error("data structure too deeply nested");
+        f();
+        depth--;
+    }
+};
+
+// See vmdata.h, used by channel_send() in lobster.cpp and parallel_map() in parallel.cpp.
+string lobster::SerializeValue(const Value &v)
+{
+    ValueWriter ser(true);
+    ser.Write(v);
+    return ser.Finish();
+}
+
+Value lobster::DeserializeValue(const string &s)
+{
+    ValueReader des((const uchar *)s.data(), s.size());
+    return des.Parse().INC();
+}
+
+void AddSerialize()
+{
+    STARTDECL(serialize) (Value &v, Value &shared)
+    {
+        try
+        {
+            ValueWriter ser(shared.True());
+            ser.Write(v);
+            v.DEC();
+            auto s = ser.Finish();
+            return Value(g_vm->NewString(s.data(), (int)s.size()));
+        }
+        catch (string &s)
+        {
+            v.DEC();
+            return g_vm->BuiltinError("serialize: " + s);
+        }
+    }
+    ENDDECL2(serialize, "value,shared", "Ai", "S",
+        "converts a data structure (int/float/string/vector/hashmap/buffer/pvector and structs) into a compact binary"
+        " string, much faster to write and read back with deserialize() than going through a text string and"
+        " parse_data(). if shared is true, values referred to from more than one place are stored once and will be"
+        " shared again after deserialize(), which also allows cyclic data structures. otherwise they are stored"
+        " once for each reference.");
+
+    STARTDECL(deserialize) (Value &ins)
+    {
+        Value r;
+        try
+        {
+            ValueReader des((const uchar *)ins.sval->str(), ins.sval->len);
+            g_vm->Push(des.Parse().INC());
+            r = Value(0, V_NIL);
+        }
+        catch (string &s)
+        {
+            g_vm->Push(Value(0, V_NIL));
+            r = Value(g_vm->NewString(s));
+        }
+        ins.DEC();
+        return r;
+    }
+    ENDDECL1(deserialize, "data", "S", "As",
+        "turns a string created by serialize() back into a data structure. structs are made compatible with their"
+        " current definitions in the same way as parse_data(). returns the value and an error string as second"
+        " return value (or nil if no error)");
+}
+
+AutoRegister __aser("serialize", AddSerialize);
@@ -0,0 +1,282 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+using namespace lobster;
+
+// All sorts below only ever index within [0, n), even if the comparator is inconsistent (which user supplied ones
+// may well be), so the worst that can happen is an unsorted result. They also only ever move elements by swapping
+// them, so whenever the comparator runs each element sits in exactly one place in a (or MergeSort's tmp), which is
+// what lets SortVector keep them all reachable for collect_garbage().
+
+template<typename T, typename LT> void InsertionSort(T *a, int n, LT &lt)
+{
+    for (int i = 1; i < n; i++)
+        for (int j = i; j > 0 && lt(a[j], a[j - 1]); j--) swap(a[j], a[j - 1]);
+}
+
+template<typename T, typename LT> void HeapSort(T *a, int n, LT &lt)
+{
+    auto siftdown = [&](int i, int len)
+    {
+        for (;;)
+        {
+            int c = 2 * i + 1;
+            if (c >= len) return;
+            if (c + 1 < len && lt(a[c], a[c + 1])) c++;
+            if (!lt(a[i], a[c])) return;
+            swap(a[i], a[c]);
+            i = c;
+        }
+    };
+    for (int i = n / 2 - 1; i >= 0; i--) siftdown(i, n);
+    for (int i = n - 1; i > 0; i--) { swap(a[0], a[i]); siftdown(0, i); }
+}
+
+template<typename T, typename LT> void IntroSort(T *a, int n, int depth, LT &lt)
+{
+    while (n > 16)
+    {
+        if (!depth--)
+        {
+            // quicksort is degenerating, fall back to heapsort
+            HeapSort(a, n, lt);
+            return;
+        }
+        // median of 3, moved to a[0] as pivot
+        int m = n / 2;
+        if (lt(a[m], a[0])) swap(a[m], a[0]);
+        if (lt(a[n - 1], a[m])) { swap(a[n - 1], a[m]); if (lt(a[m], a[0])) swap(a[m], a[0]); }
+        swap(a[0], a[m]);
+        T pivot = a[0];     // stays in a[0] until the partition is done
+        int i = 0, j = n;
+        for (;;)
+        {
+            do i++; while (i < n && lt(a[i], pivot));
+            do j--; while (j > 0 && lt(pivot, a[j]));
+            if (i >= j) break;
+            swap(a[i], a[j]);
+        }
+        swap(a[0], a[j]);
+        // recurse on the smaller half, iterate on the larger one
+        if (j < n - j - 1) { IntroSort(a, j, depth, lt); a += j + 1; n -= j + 1; }
+        else               { IntroSort(a + j + 1, n - j - 1, depth, lt); n = j; }
+    }
+    InsertionSort(a, n, lt);
+}
+
+// tmp holds n / 2 + 1 placeholders on entry, and again on exit.
+template<typename T, typename LT> void MergeSort(T *a, T *tmp, int n, LT &lt)
+{
+    if (n <= 16) { InsertionSort(a, n, lt); return; }
+    int h = n / 2;
+    MergeSort(a, tmp, h, lt);
+    MergeSort(a + h, tmp, n - h, lt);
+    if (!lt(a[h], a[h - 1])) return;    // already in order
+    swap_ranges(a, a + h, tmp);
+    // a[k, j) are always the placeholders, so each merge step swaps the next element into the first of them
+    int i = 0, j = h, k = 0;
+    while (i < h && j < n) swap(a[k++], lt(a[j], tmp[i]) ? a[j++] : tmp[i++]);
+    while (i < h) swap(a[k++], tmp[i++]);
+}
+
+template<typename T, typename LT> void SortRange(T *a, int n, bool stable, LT lt, T *tmp = nullptr)
+{
+    if (n < 2) return;
+    if (stable)
+    {
+        vector<T> owntmp;
+        if (!tmp) { owntmp.resize(n / 2 + 1); tmp = owntmp.data(); }
+        MergeSort(a, tmp, n, lt);
+    }
+    else
+    {
+        int depth = 0;
+        for (int i = n; i > 1; i >>= 1) depth += 2;
+        IntroSort(a, n, depth, lt);
+    }
+}
+
+// Sorts without calling back into the VM when all keys are ints, all floats (or a mix of the two), or all strings.
+// KEY gets the Value to compare from an element.
+template<typename T, typename KEY> void NaturalSort(T *a, int n, bool stable, KEY key, const char *name)
+{
+    bool allint = true, allnum = true, allstr = true;
+    for (int i = 0; i < n; i++)
+    {
+        auto t = key(a[i]).type;
+        allint = allint && t == V_INT;
+        allnum = allnum && (t == V_INT || t == V_FLOAT);
+        allstr = allstr && t == V_STRING;
+    }
+    auto num = [](const Value &v) { return v.type == V_FLOAT ? v.fval : (float)v.ival; };
+    if (allint)
+        SortRange(a, n, stable, [&](const T &x, const T &y) { return key(x).ival < key(y).ival; });
+    else if (allnum)
+        SortRange(a, n, stable, [&](const T &x, const T &y) { return num(key(x)) < num(key(y)); });
+    else if (allstr)
+        SortRange(a, n, stable, [&](const T &x, const T &y) { return *key(x).sval < *key(y).sval; });
+    else
+        g_vm->BuiltinError(string(name) + ": without a comparator, keys must be all numbers or all strings");
+}
+
+// Whether xs still holds the very same elements, used to check comparators and key functions left it alone.
+static bool SameElems(LVector *vec, const Value *elems, int n)
+{
+    if (vec->len != n) return false;
+    for (int i = 0; i < n; i++)
+    {
+        const Value &a = vec->at(i), &b = elems[i];
+        if (a.type != b.type || (a.type < 0 ? a.ref != b.ref : a.ival != b.ival)) return false;
+    }
+    return true;
+}
+
+// Comparators and key functions are lobster code that may call collect_garbage() or change xs, so while they run
+// the elements are held by a vector of our own on the VM stack, followed by extra nil placeholders.
+static LVector *PushElems(LVector *vec, int extra)
+{
+    auto work = g_vm->NewVector(vec->len + extra, V_VECTOR);
+    for (int i = 0; i < vec->len; i++) work->push(Value(vec->at(i)).INC());
+    for (int i = 0; i < extra; i++) work->push(Value(0, V_NIL));
+    g_vm->Push(Value(work));
+    return work;
+}
+
+static Value SortVector(Value &xs, Value &lt, bool stable, const char *name)
+{
+    auto vec = xs.vval;
+    vec->Unshare();
+    g_vm->Push(xs);
+    if (vec->len > 1)
+    {
+        int n = vec->len;
+        if (lt.type == V_NIL)
+        {
+            NaturalSort(&vec->at(0), n, stable, [](const Value &v) -> const Value & { return v; }, name);
+        }
+        else
+        {
+            // sort the copy, with the placeholders as MergeSort's tmp, then swap the result into xs
+            vector<Value> orig(&vec->at(0), &vec->at(0) + n);
+            auto work = PushElems(vec, stable ? n / 2 + 1 : 0);
+            auto a = &work->at(0);
+            SortRange(a, n, stable, [&](const Value &x, const Value &y) -> bool
+            {
+                g_vm->Push(Value(x).INC());
+                g_vm->Push(Value(y).INC());
+                auto r = g_vm->EvalC(lt, 2);
+                bool before = r.True();
+                r.DEC();
+                return before;
+            }, a + n);
+            if (!SameElems(vec, orig.data(), n))
+                g_vm->BuiltinError(string(name) + ": comparator must not change the vector being sorted");
+            vec->Unshare();     // in case the comparator made a copy of it
+            for (int i = 0; i < n; i++) swap(vec->at(i), a[i]);
+            g_vm->Pop().DEC();  // work now holds the references xs had before
+        }
+    }
+    g_vm->Pop();
+    return xs;
+}
+
+struct KeyedElem
+{
+    Value key;
+    Value elem;
+};
+
+void AddSort()
+{
+    STARTDECL(sort) (Value &xs, Value &lt)
+    {
+        return SortVector(xs, lt, false, "sort");
+    }
+    ENDDECL2(sort, "xs,lt", "Vc", "V1",
+        "sorts xs in place (introsort), and returns it. without a comparator, xs must be all numbers or all strings"
+        " and is sorted ascending without calling any lobster code. otherwise lt(a, b) should return wether a"
+        " sorts before b. not stable, use stable_sort() or sort_by_key() if you need that.");
+
+    STARTDECL(stable_sort) (Value &xs, Value &lt)
+    {
+        return SortVector(xs, lt, true, "stable_sort");
+    }
+    ENDDECL2(stable_sort, "xs,lt", "Vc", "V1",
+        "like sort(), but elements that compare equal keep their relative order (merge sort)");
+
+    STARTDECL(sort_by_key) (Value &xs, Value &key)
+    {
+        auto vec = xs.vval;
+        if (key.type != V_INT && key.type != V_FUNCTION)
+            g_vm->BuiltinError("sort_by_key: key must be a field index or a function");
+        vec->Unshare();
+        g_vm->Push(xs);
+        int n = vec->len;
+        vector<KeyedElem> elems(n);
+        LVector *work = nullptr, *keys = nullptr;
+        if (key.type == V_FUNCTION)
+        {
+            // like SortVector, keep the elements and the keys computed so far on the VM stack
+            work = PushElems(vec, 0);
+            keys = g_vm->NewVector(n, V_VECTOR);
+            g_vm->Push(Value(keys));
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (key.type == V_INT)
+            {
+                auto &e = vec->at(i);
+                if (e.type != V_VECTOR || key.ival < 0 || key.ival >= e.vval->len)
+                    g_vm->BuiltinError("sort_by_key: element does not have field " + string(inttoa(key.ival)));
+                elems[i].elem = e;
+                elems[i].key = e.vval->at(key.ival);
+            }
+            else
+            {
+                auto &e = work->at(i);
+                g_vm->Push(Value(e).INC());
+                auto k = g_vm->EvalC(key, 1);
+                keys->push(k);
+                elems[i].elem = e;
+                elems[i].key = k;
+            }
+        }
+        if (work && n && !SameElems(vec, &work->at(0), n))
+            g_vm->BuiltinError("sort_by_key: key function must not change the vector being sorted");
+        if (n > 1)
+            NaturalSort(elems.data(), n, true, [](const KeyedElem &ke) -> const Value & { return ke.key; },
+                        "sort_by_key");
+        vec->Unshare();     // in case the key function made a copy of it
+        for (int i = 0; i < n; i++) vec->at(i) = elems[i].elem;
+        if (work)
+        {
+            g_vm->Pop().DEC();  // keys
+            g_vm->Pop().DEC();  // work, holding the same elements as xs
+        }
+        g_vm->Pop();
+        return xs;
+    }
+    ENDDECL2(sort_by_key, "xs,key", "VA", "V1",
+        "sorts xs in place by a key per element, and returns it. key is either an int, meaning elements are"
+        " vectors/structs sorted by that field (e.g. sort_by_key(entities, 2)), or a function that computes"
+        " the key from an element, called once per element. keys must be all numbers or all strings."
+        " stable: elements with equal keys keep their relative order.");
+}
+
+AutoRegister __asort("sort", AddSort);
@@ -54,6 +54,13 @@ typedef unsigned long ulong;
 #endif
 #define nullptr nullptr
 
+// Not all our compilers support thread_local yet. Only for pointers and other POD types.
+#ifdef _MSC_VER
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL __thread
+#endif
+
 // our universally used headers
 #include "platform.h"
 #include "tools.h"
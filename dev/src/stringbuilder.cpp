@@ -0,0 +1,80 @@
+// Copyright 2014 Wouter van Oortmerssen. All rights reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "stdafx.h"
+
+#include "vmdata.h"
+#include "natreg.h"
+
+using namespace lobster;
+
+void AddStringBuilder()
+{
+    STARTDECL(stringbuilder) (Value &reserve)
+    {
+        auto sb = g_vm->NewStringBuilder();
+        if (reserve.ival > 0) sb->buf.reserve(reserve.ival);
+        return Value(sb);
+    }
+    ENDDECL1(stringbuilder, "reserve", "i", "T",
+        "creates a new empty string builder, optionally with room for reserve characters."
+        " appending to it is amortized constant time, unlike repeatedly creating new strings with +");
+
+    STARTDECL(stringbuilder_append) (Value &sb, Value &x)
+    {
+        auto &buf = sb.sbval->buf;
+        if (x.type == V_STRING) buf.append(x.sval->str(), x.sval->len);
+        else x.ToString(buf, g_vm->programprintprefs);
+        x.DEC();
+        return sb;
+    }
+    ENDDECL2(stringbuilder_append, "sb,x", "TA", "T",
+        "appends x to the builder, converted to a string the same way + does. returns the builder.");
+
+    STARTDECL(stringbuilder_append_number) (Value &sb, Value &x, Value &decimals)
+    {
+        auto &buf = sb.sbval->buf;
+        switch (x.type)
+        {
+            case V_INT:   buf += inttoa(x.ival); break;
+            case V_FLOAT: buf += flttoa(x.fval, decimals.type == V_INT ? decimals.ival : -1); break;
+            default: g_vm->BuiltinError("stringbuilder_append_number: x must be an int or float");
+        }
+        return sb;
+    }
+    ENDDECL3(stringbuilder_append_number, "sb,x,decimals", "TAi", "T",
+        "appends the number x to the builder, with floats using the given number of decimals (6 when omitted)."
+        " returns the builder.");
+
+    STARTDECL(stringbuilder_string) (Value &sb)
+    {
+        auto &buf = sb.sbval->buf;
+        auto s = g_vm->NewString(buf.c_str(), (int)buf.size());
+        sb.DECRT();
+        return Value(s);
+    }
+    ENDDECL1(stringbuilder_string, "sb", "T", "S",
+        "returns the contents of the builder as a string. the builder keeps its contents.");
+
+    STARTDECL(stringbuilder_clear) (Value &sb)
+    {
+        sb.sbval->buf.clear();
+        return sb;
+    }
+    ENDDECL1(stringbuilder_clear, "sb", "T", "T",
+        "empties the builder (keeping its memory for reuse), returns it");
+}
+
+AutoRegister __asb("stringbuilder", AddStringBuilder);
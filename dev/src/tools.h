@@ -313,14 +313,14 @@ struct Serializer
 
 inline char *inttoa(int i)
 {
-    static char _buf[100];
+    static THREAD_LOCAL char _buf[100];   // VMs on other threads convert numbers too
     snprintf(_buf, 100, "%d", i);
     return _buf;
 }
 
 inline char *flttoa(double f, int decimals = -1)
 {
-    static char _buf[100];
+    static THREAD_LOCAL char _buf[100];
     if (decimals < 0) snprintf(_buf, 100, "%f", f);
     else              snprintf(_buf, 100, "%.*f", decimals, f);
     return _buf; 
@@ -1076,7 +1076,8 @@ struct TypeChecker
                 auto itertype = Promote(n.for_iter()->exptype);
                 if (itertype.t == V_INT || itertype.t == V_STRING) itertype = Type(V_INT);
                 else if (itertype.t == V_VECTOR) itertype = itertype.Element();
-                else TypeError("for can only iterate over int/string/vector, not: " + TypeName(itertype), n);
+                else if (itertype.t == V_BUFFER) itertype = Type(V_ANY);
+                else TypeError("for can only iterate over int/string/vector/buffer, not: " + TypeName(itertype), n);
                 args->head()->exptype = itertype;
                 args->tail()->head()->exptype = Type(V_INT);
                 TypeCheckDynCall(*n.for_body(), &args);
@@ -1163,12 +1164,15 @@ struct TypeChecker
             case T_INDEX:
             {
                 auto vtype = Promote(n.left()->exptype);
-                if (vtype.t != V_VECTOR && vtype.t != V_STRING)
-                    TypeError("vector/string", vtype, n, "container");
+                if (vtype.t != V_VECTOR && vtype.t != V_STRING && vtype.t != V_BUFFER)
+                    TypeError("vector/string/buffer", vtype, n, "container");
                 auto itype = Promote(n.right()->exptype);
                 switch (itype.t)
                 {
-                    case V_INT: vtype = vtype.t == V_VECTOR ? vtype.Element() : Type(V_INT); break;
+                    case V_INT:
+                        // buffer elements are int or float depending on the buffer kind, only known at runtime
+                        vtype = vtype.t == V_VECTOR ? vtype.Element() : Type(vtype.t == V_BUFFER ? V_ANY : V_INT);
+                        break;
                     case V_STRUCT:
                     {
                         auto &struc = *st.structtable[itype.idx];
@@ -32,12 +32,17 @@ struct VM : VMBase
     {
         INITSTACKSIZE   =   4 * 1024, // *8 bytes each
         DEFMAXSTACKSIZE = 128 * 1024, // *8 bytes each, modest on smallest handheld we support (iPhone 3GS has 256MB)
-        STACKMARGIN     =   1 * 1024  // *8 bytes each, max by which the stack could possibly grow in a single call
+        STACKMARGIN     =   1 * 1024, // *8 bytes each, max by which the stack could possibly grow in a single call
+        COSTACKSIZE     =   2 * 1024, // *8 bytes each, initial size of the stack of each coroutine
+        COSTACKPOOLSIZE =        256  // max stacks of finished coroutines kept around for new ones to reuse
     }; 
 
+    enum { CALLBACKRET_POS = 2 };   // see CodeGen::GenFieldTables
+
     int *ip;
 
     CoRoutine *curcoroutine;
+    vector<Value *> costackpool;    // stacks of size COSTACKSIZE, see FreeCoStack
 
     Value *vars;
     
@@ -59,6 +64,10 @@ struct VM : VMBase
     PrintPrefs debugpp;
 
     vector<int> default_vector_types;
+
+    vector<LString *> interned;         // open addressing hash set, holds a reference to each string in it
+    int numinterned;
+    vector<LString *> constantstrings;  // string literal slot -> its interned string (owned by interned)
     
     const char *programname;
 
@@ -75,7 +84,8 @@ struct VM : VMBase
     VM(SymbolTable &_st, int *_code, int _len, const vector<LineInfo> &_lineinfo, const char *_pn)
         : stack(nullptr), stacksize(0), maxstacksize(DEFMAXSTACKSIZE), sp(-1), ip(nullptr),
           curcoroutine(nullptr), vars(nullptr), st(_st), codelen(_len), byteprofilecounts(nullptr), lineprofilecounts(nullptr),
-          trace(false), lineinfo(_lineinfo), debugpp(2, 50, true, -1), programname(_pn), vml(*this, st.uses_frame_state)
+          trace(false), lineinfo(_lineinfo), debugpp(2, 50, true, -1), programname(_pn), numinterned(0),
+          vml(*this, st.uses_frame_state)
     {
         // search for "64bit" before trying to make a 64bit build, changes may be required
         assert(sizeof(int) == sizeof(void *));
@@ -121,6 +131,8 @@ struct VM : VMBase
         if (stack) delete[] stack;
         if (vars)  delete[] vars;
 
+        for (auto s : costackpool) delete[] s;
+
         if (byteprofilecounts) delete[] byteprofilecounts;
         if (lineprofilecounts) delete[] lineprofilecounts;
 
@@ -179,7 +191,9 @@ struct VM : VMBase
                         case V_STRING:
                         {
                             auto str = (LString *)vec;
-                            fputs((str->CycleStr() + " = " + str->ToString(leakpp) + "\n").c_str(), leakf);
+                            string s = str->CycleStr() + " = ";
+                            str->ToString(s, leakpp);
+                            fputs((s + "\n").c_str(), leakf);
                             break;
                         }
 
@@ -189,11 +203,54 @@ struct VM : VMBase
                             fputs((co->CycleStr() + " = coroutine\n").c_str(), leakf);
                             break;
                         }
+
+                        case V_BUFFER:
+                        {
+                            auto buf = (LBuffer *)vec;
+                            string s = buf->CycleStr() + " = ";
+                            buf->ToString(s, leakpp);
+                            fputs((s + "\n").c_str(), leakf);
+                            break;
+                        }
+
+                        case V_HASHMAP:
+                        {
+                            auto hm = (LHashMap *)vec;
+                            string s = hm->CycleStr() + " = ";
+                            hm->ToString(s, leakpp);
+                            fputs((s + "\n").c_str(), leakf);
+                            break;
+                        }
+
+                        case V_PQUEUE:
+                        {
+                            auto pq = (LPQueue *)vec;
+                            fputs((pq->CycleStr() + " = pqueue\n").c_str(), leakf);
+                            break;
+                        }
+
+                        case V_STRINGBUILDER:
+                        {
+                            auto sb = (LStringBuilder *)vec;
+                            fputs((sb->CycleStr() + " = stringbuilder\n").c_str(), leakf);
+                            break;
+                        }
+
+                        case V_PVECTOR:
+                        {
+                            auto pv = (LPVector *)vec;
+                            string s = pv->CycleStr() + " = ";
+                            pv->ToString(s, leakpp);
+                            fputs((s + "\n").c_str(), leakf);
+                            break;
+                        }
                                     
                         default:
                         {
                             assert(vec->type >= V_VECTOR);
-                            fputs((vec->CycleStr() + " = " + vec->ToString(leakpp) + "\n").c_str(), leakf);
+                            string s = vec->CycleStr() + " = ";
+                            vec->ToString(s, leakpp);
+                            fputs((s + "\n").c_str(), leakf);
                             break;
                         }
                     }
@@ -210,10 +267,112 @@ struct VM : VMBase
     
     #undef new
     LVector *NewVector(int n, int t) { return new (vmpool->alloc(sizeof(LVector) + sizeof(Value) * n)) LVector(n, t); }
-    LString *NewString(int l) { return new (vmpool->alloc(sizeof(LString) + l + 1)) LString(l); }
+    LString *NewString(int l) { return new (vmpool->alloc(sizeof(LString) + LString::AllocSize(l))) LString(l); }
+    LBuffer *NewBuffer(int n, int et)
+    {
+        auto b = new (vmpool->alloc(sizeof(LBuffer) + n * LBuffer::ElemSize(et))) LBuffer(n, et);
+        memset(b->bdata(), 0, b->bytes());
+        return b;
+    }
+    LPQueue *NewPQueue() { return new (vmpool->alloc(sizeof(LPQueue))) LPQueue(); }
+    // A new string with size characters of s from start. When those run to the end of s, and are at least half of
+    // the string that owns them, this is a view sharing the characters rather than a copy. So repeatedly chopping
+    // the front off a big string is linear overall, while a view never keeps more than twice its size alive.
+    LString *SubString(LString *s, int start, int size)
+    {
+        auto base = s->base ? s->base : s;
+        if (start + size == s->len && size >= 128 && size * 2 >= base->len)
+        {
+            auto v = new (vmpool->alloc(sizeof(LString))) LString(size);
+            v->base = base;
+            base->refc++;
+            return v;
+        }
+        return NewString(s->str() + start, size);
+    }
+
+    // Returns the one interned string with the same contents as s, which is s itself if there was none yet.
+    // Takes over the caller's reference to s, and returns one to the result.
+    LString *Intern(LString *s)
+    {
+        if (s->interned) return s;
+        if (numinterned * 2 >= (int)interned.size())
+        {
+            vector<LString *> old(max(interned.size() * 2, (size_t)64), nullptr);
+            old.swap(interned);
+            for (auto o : old) if (o) interned[FindInterned(o)] = o;
+        }
+        auto &slot = interned[FindInterned(s)];
+        if (slot)
+        {
+            Value(s).DECRT();
+            return (LString *)Value(slot).INC().sval;
+        }
+        s->interned = true;
+        s->refc++;  // for the table
+        numinterned++;
+        return slot = s;
+    }
+
+    // index of the slot with a string equal to s, or the empty slot it would go in
+    size_t FindInterned(LString *s)
+    {
+        auto mask = interned.size() - 1;
+        for (auto i = s->Hash() & mask; ; i = (i + 1) & mask)
+            if (!interned[i] || *interned[i] == *s) return i;
+    }
+
+    void ReleaseInterned()
+    {
+        for (auto &s : interned) if (s)
+        {
+            s->interned = false;
+            Value(s).DECRT();
+            s = nullptr;
+        }
+        numinterned = 0;
+        constantstrings.clear();
+    }
+
+    // The table doesn't act as a GC root: called after marking, it keeps the strings only it refers to, and drops
+    // the ones that are otherwise referenced only by garbage, so they get freed along with it.
+    void MarkInterned()
+    {
+        bool dropped = false;
+        for (auto &s : interned) if (s && s->refc > 0)
+        {
+            if (s->refc == 1) { s->Mark(); continue; }
+            s->interned = false;
+            dropped = true;
+        }
+        if (!dropped) return;
+        vector<LString *> old(interned.size(), nullptr);
+        old.swap(interned);
+        numinterned = 0;
+        for (auto o : old) if (o && o->interned) { interned[FindInterned(o)] = o; numinterned++; }
+        for (auto &cs : constantstrings) if (cs && !cs->interned) cs = nullptr;
+    }
+
+    LStringBuilder *NewStringBuilder() { return new (vmpool->alloc(sizeof(LStringBuilder))) LStringBuilder(); }
+    LPVector *NewPVector() { return new (vmpool->alloc(sizeof(LPVector))) LPVector(); }
+    LHashMap *NewHashMap(int reserve)
+    {
+        auto hm = new (vmpool->alloc(sizeof(LHashMap))) LHashMap();
+        if (reserve > 0) hm->Reserve(reserve);
+        return hm;
+    }
     CoRoutine *NewCoRoutine(int *rip, int *vip, CoRoutine *p)
     {
-        return new (vmpool->alloc(sizeof(CoRoutine))) CoRoutine(sp + 2 /* top of sp + pushed coro */, rip, vip, p);
+        Value *costack;
+        if (costackpool.size()) { costack = costackpool.back(); costackpool.pop_back(); }
+        else costack = new Value[COSTACKSIZE];
+        return new (vmpool->alloc(sizeof(CoRoutine))) CoRoutine(rip, vip, p, costack, COSTACKSIZE);
+    }
+    void FreeCoStack(Value *s, int size)
+    {
+        // stacks that grew past the initial size are rare, not worth keeping
+        if (size == COSTACKSIZE && costackpool.size() < COSTACKPOOLSIZE) costackpool.push_back(s);
+        else delete[] s;
     }
     #ifdef WIN32
     #ifdef _DEBUG
@@ -262,7 +421,17 @@ struct VM : VMBase
         {
             TempCleanup();
 
-            if (sp < 0) break;
+            if (sp < 0)
+            {
+                if (!curcoroutine) break;
+                // continue unwinding whoever resumed it. its frames have restored the parent's values of its vars,
+                // so like CoClean there is nothing left in varbackup it owns.
+                auto co = curcoroutine;
+                CoDone(ip);
+                co->Finish();
+                s += "\nin coroutine";
+                continue;
+            }
         
             string locals;
             int deffun = varcleanup(s.length() < 10000 ? &locals : nullptr);
@@ -380,11 +549,44 @@ struct VM : VMBase
 
         for (size_t i = 0; i < st.identtable.size(); i++) vars[i].DEC();
 
+        ReleaseInterned();
+
         #ifdef _DEBUG
             DebugLog(0, (string("stack at its highest was: ") + inttoa(maxsp)).c_str());
         #endif
     }
     
+    void SnapshotVars(vector<VarSnapshot> &snap)
+    {
+        for (size_t i = 0; i < st.identtable.size(); i++)
+        {
+            auto &v = vars[i];
+            if (v.type == V_UNDEFINED) continue;
+            VarSnapshot vs;
+            vs.idx = (int)i;
+            if (v.type < 0)
+            {
+                // things that can't be serialized (coroutines) stay undefined in the worker
+                try { vs.data = SerializeValue(v); } catch (string &) { continue; }
+            }
+            else
+            {
+                vs.scalar = v;
+            }
+            snap.push_back(vs);
+        }
+    }
+
+    void RunWorker(const vector<VarSnapshot> &snap, const function<void()> &f)
+    {
+        // becomes g_vm for this thread, errors in f have already cleaned it up when they get here
+        VM worker(st, codestart, (int)codelen, lineinfo, programname);
+        for (auto &vs : snap) worker.vars[vs.idx] = vs.data.size() ? DeserializeValue(vs.data) : vs.scalar;
+        f();
+        worker.FinalStackVarsCleanup();
+        worker.vml.LogCleanup();
+    }
+
     int CallerId()
     {
         for (int _sp = sp; _sp >= 0; _sp--)
@@ -457,7 +659,8 @@ struct VM : VMBase
             delete[] stack;
             stack = nstack;
 
-            DebugLog(0, (string("stack grew to: ") + inttoa(stacksize)).c_str());
+            // coroutine stacks start small and routinely grow, only the main stack is worth a mention
+            if (!curcoroutine) DebugLog(0, (string("stack grew to: ") + inttoa(stacksize)).c_str());
         }
 
         auto nargs_fun = *ip++;
@@ -544,6 +747,9 @@ struct VM : VMBase
             }
             int deffun = varcleanup(nullptr);
             if(towhere == -1 || towhere == deffun) break;
+            if (ip == codestart + CALLBACKRET_POS)
+                Error("\"return from " + st.ReverseLookupFunction(towhere) +
+                      "\" cannot return out of a function called by a native function");
         }
         //PUSH(ret);
         memcpy(TOPPTR(), rvs, nrv * sizeof(Value));
@@ -568,32 +774,36 @@ struct VM : VMBase
     {
         int *returnip = codestart + *ip++;
         CoNonRec(ip);
-        curcoroutine = NewCoRoutine(returnip, ip, curcoroutine);
-        curcoroutine->BackupParentVars(vars);
+        auto co = NewCoRoutine(returnip, ip, curcoroutine);
+        co->BackupParentVars(vars);
         int nvars = *ip++;
         ip += nvars;
-        PUSH(Value(curcoroutine));
+        PUSH(Value(co));    // on the parent's stack, where it will be the value of this expression once it yields
+        curcoroutine = co;
+        co->SwapStack(stack, stacksize, sp);
     }
 
     void CoDone(int *retip)
     {
-        int newtop = curcoroutine->Suspend(sp + 1, stack, retip, curcoroutine);
+        curcoroutine->Suspend(stack, stacksize, sp, retip, curcoroutine);
         ip = retip;
-        sp = newtop - 1; // top of stack is now coro value from create or resume
+        // top of stack is now coro value from create or resume
     }
 
     void CoClean()
     {
+        // the coroutine function has returned, which restored the parent's values of its vars already, so these are
+        // just the same values
         for (int i = 1; i <= *curcoroutine->varip; i++)
         {
-            auto &var = vars[curcoroutine->varip[i]];
-            var = curcoroutine->stackcopy[i - 1];
+            auto idx = curcoroutine->varip[i];
+            if (idx >= 0) vars[idx] = curcoroutine->varbackup[i - 1];
         }
 
         auto co = curcoroutine;
         CoDone(ip);
-        VMASSERT(co->stackcopylen == 1);
-        co->active = false;
+        VMASSERT(co->sp == 0);  // just the return value
+        co->Finish();
     }
 
     void CoYield(int nargs_given, int *retip)
@@ -614,13 +824,7 @@ struct VM : VMBase
         Value ret(0, V_NIL);  
         if (nargs_given) ret = POP();
 
-        for (int i = 1; i <= *curcoroutine->varip; i++)
-        {
-            auto &var = vars[curcoroutine->varip[i]];
-            PUSH(var);
-            //var.type = V_UNDEFINED;
-            var = curcoroutine->stackcopy[i - 1];
-        }
+        curcoroutine->SwapVars(vars);
 
         PUSH(ret);  // current value always top of the stack
         CoDone(retip);
@@ -628,7 +832,7 @@ struct VM : VMBase
 
     void CoResume(CoRoutine *co)
     {
-        if (co->stackstart >= 0)
+        if (co->running)
             Error("cannot resume running coroutine");
 
         if (!co->active)
@@ -637,27 +841,31 @@ struct VM : VMBase
         PUSH(Value(co));    // this will be the return value for the corresponding yield, and holds the ref for gc
 
         CoNonRec(co->varip);
-        sp += co->Resume(sp + 1, stack, ip, curcoroutine);
-
-        curcoroutine = co;
-
-        // must be, since those vars got backed up in it before
-        VMASSERT(curcoroutine->stackcopymax >= (size_t)*curcoroutine->varip);
-        curcoroutine->stackcopylen = *curcoroutine->varip;
-        //curcoroutine->BackupParentVars(vars);
+        co->Resume(stack, stacksize, sp, ip, curcoroutine);
 
         POP().DEC();    // previous current value
 
-        for (int i = *curcoroutine->varip; i > 0; i--)
-        {
-            auto &var = vars[curcoroutine->varip[i]];
-            curcoroutine->stackcopy[i - 1] = var; // no INC, since parent is still on the stack and hold ref for us
-            var = POP();
-        }
+        co->SwapVars(vars); // no INC, since parent is still on the stack and hold ref for us
 
         // the builtin call takes care of the return value
     }
 
+    // resumes from native code: like EvalC, the resumer continues at the IL_CALLBACKRET stub, so the nested
+    // EvalProgram returns as soon as co yields or finishes
+    void CoRunUntilYield(CoRoutine *co, const Value &ret)
+    {
+        auto oldip = ip;
+        ip = codestart + CALLBACKRET_POS;
+        VMASSERT(*ip == IL_CALLBACKRET);
+        Value(co).INC();    // for CoResume to push on our stack, where the resume() builtin passes its arg's ref
+        CoResume(co);
+        PUSH(ret);          // the value of its yield, now on co's stack
+        string evalret;
+        EvalProgram(evalret);
+        ip = oldip;
+        POP().DEC();        // co, back on our stack
+    }
+
     void Require(const Value &v, ValueType t, const char *op) // FIXME: make this a macro so we don't pass this extra string
     {
         if (v.type != t)
@@ -695,6 +903,22 @@ struct VM : VMBase
         #endif
     }
 
+    // calls a function value from native code (e.g. a sort comparator), with the args already on the stack.
+    // runs a nested EvalProgram until the function returns to the IL_CALLBACKRET stub
+    Value EvalC(const Value &fun, int nargs)
+    {
+        if (fun.type != V_FUNCTION || fun.ip == (int *)Value::FAKE_COCLOSURE_ADDRESS)
+            Error("native function requires a function value", fun);
+        auto callbackret = codestart + CALLBACKRET_POS;
+        VMASSERT(*callbackret == IL_CALLBACKRET);
+        auto oldip = ip;
+        FunIntro(nargs, fun.ip, -1, callbackret);
+        string evalret;
+        EvalProgram(evalret);
+        ip = oldip;
+        return POP();
+    }
+
     void EvalProgram(string &evalret)
     {
         for (;;)
@@ -734,14 +958,21 @@ struct VM : VMBase
 
                 case IL_PUSHSTR:
                 {
-                    auto start = ip;
-                    while (*ip++) ;
-                    auto len = (int)(ip - start);
-                    // FIXME: have a way that constant strings can stay in the bytecode,
-                    // or at least preallocate them all
-                    auto s = NewString(len - 1);
-                    for (int i = 0; i < len; i++) s->str()[i] = (char)start[i]; 
-                    PUSH(Value(s));
+                    // literals are interned the first time they are pushed, and shared from then on
+                    int slot = *ip++;
+                    int len = *ip++;
+                    if (slot >= (int)constantstrings.size()) constantstrings.resize(slot + 1, nullptr);
+                    auto &cs = constantstrings[slot];
+                    if (!cs)
+                    {
+                        auto s = NewString(len);
+                        for (int i = 0; i < len; i++) s->str()[i] = (char)ip[i];
+                        s->str()[len] = 0;
+                        cs = Intern(s);
+                        cs->refc--;  // the table keeps it alive
+                    }
+                    ip += len + 1;
+                    PUSH(Value(cs).INC());
                     break;
                 }
 
@@ -801,6 +1032,9 @@ struct VM : VMBase
                 case IL_EXIT:
                     return EndEval(evalret);
 
+                case IL_CALLBACKRET:    // function called by EvalC has returned, or CoRunUntilYield's coroutine yielded
+                    return;
+
                 case IL_CONT1:
                 {
                     auto nf = natreg.nfuns[*ip++];
@@ -825,6 +1059,7 @@ struct VM : VMBase
                         case V_INT:    PUSHITER(iter.ival     , i);
                         case V_VECTOR: PUSHITER(iter.vval->len, iter.vval->at(i.ival).INC());
                         case V_STRING: PUSHITER(iter.sval->len, Value((int)((uchar *)iter.sval->str())[i.ival]));
+                        case V_BUFFER: PUSHITER(iter.bval->len, iter.bval->at(i.ival));
                         #undef PUSHITER
                         default:       Error("for: cannot iterate over argument", iter);
                     }
@@ -840,15 +1075,17 @@ struct VM : VMBase
                 }
 
                 case IL_BCALL:
+                case IL_BCALLT:     // args statically known to be of the right type
                 {
                     auto nf = natreg.nfuns[*ip++];
                     int n = *ip++;
                     if (n > (int)nf->args.v.size())
                         Error("native function \"" + nf->name + "\" called with too many arguments");
                     Value v;
+                    bool check = opc == IL_BCALL;
                     switch (nf->args.v.size())
                     {
-                        #define ARG(N) Value a##N = POP(); NFCheck(a##N, nf, N);
+                        #define ARG(N) Value a##N = POP(); if (check) NFCheck(a##N, nf, N);
                         case 0: {                                           v = nf->fun.f0(); break; }
                         case 1: { ARG(0)                                    v = nf->fun.f1(a0); break; }
                         case 2: { ARG(1) ARG(0)                             v = nf->fun.f2(a0, a1); break; }
@@ -903,6 +1140,27 @@ struct VM : VMBase
                 #define _FOP(op, extras) TYPEOP(op, extras, fval, VMASSERTVALUES(a.type == V_FLOAT && b.type == V_FLOAT, a, b))
                 #define _AIOP(op, extras) TYPEOP(op, extras, ival, if (a.type != V_INT || b.type != V_INT) BError(#op, a, b))
 
+                // Loops over vectors whose elements all have the same type as the kernel, which means no type
+                // switch per element. Scalars may be int for float kernels.
+                #define VKERNEL(op, extras, field, scalar) { \
+                    auto rv = len ? &res.vval->at(0) : nullptr; \
+                    if (a.type == V_VECTOR && b.type == V_VECTOR) { \
+                        auto av = rv ? &a.vval->at(0) : nullptr; \
+                        auto bv = rv ? &b.vval->at(0) : nullptr; \
+                        for (int j = 0; j < len; j++) { \
+                            auto y = bv[j].field; if (extras & 1 && y == 0) Div0(); rv[j] = Value(av[j].field op y); } \
+                    } else if (a.type == V_VECTOR) { \
+                        auto av = rv ? &a.vval->at(0) : nullptr; \
+                        auto y = scalar(b); if (extras & 1 && len && y == 0) Div0(); \
+                        for (int j = 0; j < len; j++) rv[j] = Value(av[j].field op y); \
+                    } else { \
+                        auto bv = rv ? &b.vval->at(0) : nullptr; \
+                        auto x = scalar(a); \
+                        for (int j = 0; j < len; j++) { \
+                            auto y = bv[j].field; if (extras & 1 && y == 0) Div0(); rv[j] = Value(x op y); } \
+                    } \
+                }
+
                 #define _AOP(op, extras, opts) Value res; for (;;) { \
                     if (a.type == V_INT) \
                     { \
@@ -915,9 +1173,14 @@ struct VM : VMBase
                         else COP(V_FLOAT, op, a.fval, b.fval, extras) \
                     } \
                     if ((extras & (8 + 16)) == 0) { \
-                        bool isfloat = true; \
-                        int len = VectorLoop(a, b, res, isfloat); \
+                        bool isfloat = true, homogeneous = false; \
+                        int len = VectorLoop(a, b, res, isfloat, homogeneous); \
                         if (len >= 0) { \
+                            if (homogeneous) { \
+                                if (isfloat) VKERNEL(op, extras, fval, ScalarF) \
+                                else         VKERNEL(op, extras, ival, ScalarI) \
+                            } \
+                            else \
                             for (int j = 0; j < len; j++) \
                             if (isfloat) { auto bv = VectorElem<float>(b, j); if (extras&1 && bv == 0) Div0(); \
                                            res.vval->at(j) = Value(VectorElem<float>(a, j) op bv); }\
@@ -988,6 +1251,44 @@ struct VM : VMBase
                 case IL_FEQ:  FOP(==, 0);
                 case IL_FNE:  FOP(!=, 0);
 
+                // Arithmetic on structs of all int or all float fields, as typechecked. Checks the values really are
+                // of that length and element type, since parse_data() and deserialize() don't hold data to the field
+                // types, and a subclass has more fields. If so, avoids VectorLoop and the per element type switch of
+                // VectorElem, otherwise does what the generic opcode would.
+                #define SOP(op, field, vt, extras) { \
+                    GETARGS(); \
+                    int len = *ip++; \
+                    if (a.type == V_VECTOR && b.type == V_VECTOR && a.vval->len == len && b.vval->len == len && \
+                        AllOfType(a.vval, vt) && AllOfType(b.vval, vt)) \
+                    { \
+                        Value res = a.vval->Unique() ? a : (b.vval->Unique() ? b : Value(NewVector(len, a.vval->type))); \
+                        res.vval->len = len; \
+                        for (int j = 0; j < len; j++) \
+                        { \
+                            auto bv = b.vval->at(j).field; \
+                            if (extras & 1 && bv == 0) Div0(); \
+                            res.vval->at(j) = Value(a.vval->at(j).field op bv); \
+                        } \
+                        VectorDec(a, res); VectorDec(b, res); \
+                        PUSH(res); \
+                        break; \
+                    } \
+                    _AOP(op, extras, {}); \
+                    PUSH(res); \
+                    break; \
+                }
+
+                case IL_SIADD: SOP(+, ival, V_INT, 2);
+                case IL_SISUB: SOP(-, ival, V_INT, 0);
+                case IL_SIMUL: SOP(*, ival, V_INT, 0);
+                case IL_SIDIV: SOP(/, ival, V_INT, 1);
+                case IL_SFADD: SOP(+, fval, V_FLOAT, 2);
+                case IL_SFSUB: SOP(-, fval, V_FLOAT, 0);
+                case IL_SFMUL: SOP(*, fval, V_FLOAT, 0);
+                case IL_SFDIV: SOP(/, fval, V_FLOAT, 1);
+
+                #undef SOP
+
                 case IL_UMINUS:
                 {
                     Value a = POP();
@@ -997,11 +1298,19 @@ struct VM : VMBase
                         case V_FLOAT: PUSH(Value(-a.fval)); break;
                         case V_VECTOR:
                         {
-                            bool isfloat = true;
+                            bool isfloat = true, homogeneous = false;
                             Value res;
-                            int len = VectorLoop(a, Value(1), res, isfloat);
+                            int len = VectorLoop(a, Value(1), res, isfloat, homogeneous);
                             if (len >= 0)
                             {
+                                if (homogeneous)
+                                {
+                                    auto av = len ? &a.vval->at(0) : nullptr;
+                                    auto rv = len ? &res.vval->at(0) : nullptr;
+                                    if (isfloat) for (int i = 0; i < len; i++) rv[i] = Value(-av[i].fval);
+                                    else         for (int i = 0; i < len; i++) rv[i] = Value(-av[i].ival);
+                                }
+                                else
                                 for (int i = 0; i < len; i++) \
                                     res.vval->at(i) = isfloat ? Value(-VectorElem<float>(a, i))
                                                               : Value(-VectorElem<int>  (a, i));
@@ -1017,6 +1326,9 @@ struct VM : VMBase
                     break;
                 }
 
+                case IL_IUMINUS: { auto &a = TOP(); VMASSERT(a.type == V_INT);   a.ival = -a.ival; break; }
+                case IL_FUMINUS: { auto &a = TOP(); VMASSERT(a.type == V_FLOAT); a.fval = -a.fval; break; }
+
                 case IL_LOGNOT:
                 {
                     Value a = POP();
@@ -1035,6 +1347,7 @@ struct VM : VMBase
                 case IL_A2S:
                 {
                     Value a = POP();
+                    if (a.type == V_STRING) { PUSH(a); break; }
                     PUSH(NewString(a.ToString(programprintprefs)));   
                     a.DEC();
                     break;
@@ -1054,6 +1367,8 @@ struct VM : VMBase
                         case V_VECTOR: \
                             if (!dyn) { VecType(r); GETOFFSET(i, r, mode); } \
                             IDXErr(i, (int)r.vval->len, r); PUSH(r.vval->at(i).INC()); break; \
+                        case V_BUFFER: if (dyn) { IDXErr(i, r.bval->len, r); PUSH(r.bval->at(i)); break; } \
+                                       Error("cannot use field access on a buffer", r); \
                         case V_NIL: if (maybe) PUSH(r); else Error("dereferencing nil"); \
                         case V_STRING: if (dyn) { IDXErr(i, r.sval->len, r); \
                                                   PUSH(Value((int)r.sval->str()[i])); break; } /* else fall thru */ \
@@ -1080,9 +1395,10 @@ struct VM : VMBase
                 case IL_PUSHLOC:
                 {
                     int i = *ip++;
+                    int slot = *ip++;
                     Value coro = POP();
                     Require(coro, V_COROUTINE, "scoped local variable");
-                    PUSH(coro.cval->GetVar(i).INC());
+                    PUSH(coro.cval->GetVar(i, slot).INC());
                     coro.DECRT();
                     break;
                 }
@@ -1091,9 +1407,10 @@ struct VM : VMBase
                 {
                     int lvalop = *ip++;
                     int i = *ip++;
+                    int slot = *ip++;
                     Value coro = POP();
                     Require(coro, V_COROUTINE, "scoped local variable");
-                    Value &a = coro.cval->GetVar(i);
+                    Value &a = coro.cval->GetVar(i, slot);
                     LvalueOp(lvalop, a);
                     coro.DECRT();
                     break;
@@ -1110,9 +1427,19 @@ struct VM : VMBase
                         i = *ip++; \
                     } \
                     Value vec = POP(); \
+                    if (dyn && vec.type == V_BUFFER) { \
+                        IDXErr(i, vec.bval->len, vec); \
+                        Value a = vec.bval->at(i); \
+                        LvalueOp(lvalop, a); \
+                        if (a.type != V_INT && a.type != V_FLOAT) Error("buffer elements must be int or float", a); \
+                        vec.bval->set(i, a); \
+                        vec.DECRT(); \
+                        break; \
+                    } \
                     Require(vec, V_VECTOR, "vector indexed assign"); \
                     if (!dyn) { VecType(vec); GETOFFSET(i, vec, mode); } \
                     CheckWritable(vec.vval); \
+                    vec.vval->Unshare(); \
                     IDXErr(i, (int)vec.vval->len, vec); \
                     Value &a = vec.vval->at(i); \
                     LvalueOp(lvalop, a); \
@@ -1374,10 +1701,45 @@ struct VM : VMBase
         }
     }
 
+    // Appends to a in place if nothing else refers to it and it has room, which makes building up a string with +=
+    // in a loop linear rather than quadratic.
+    Value AppendStr(const Value &a, const char *c, int l)
+    {
+        auto as = a.sval;
+        if (as->refc == 1 && !as->interned && as->len + l <= as->capacity())
+        {
+            memcpy(as->str() + as->len, c, l);
+            as->len += l;
+            as->str()[as->len] = 0;
+            as->hash = 0;
+            return a;
+        }
+        auto r = NewString(as->str(), as->len, c, l);
+        a.DECRT();
+        return Value(r);
+    }
+
     bool StrOps(const Value &a, const Value &b, Value &res)
     {
-        if      (a.type == V_STRING) { string s = b.ToString(programprintprefs); res = NewString(a.sval->str(), a.sval->len, (char *)s.c_str(), (int)s.size()); a.DEC(); b.DEC(); return true; }
-        else if (b.type == V_STRING) { string s = a.ToString(programprintprefs); res = NewString((char *)s.c_str(), (int)s.size(), b.sval->str(), b.sval->len); a.DEC(); b.DEC(); return true; }
+        if (a.type == V_STRING)
+        {
+            if (b.type == V_STRING) { res = AppendStr(a, b.sval->str(), b.sval->len); b.DECRT(); return true; }
+            string s;
+            b.ToString(s, programprintprefs);
+            res = AppendStr(a, s.c_str(), (int)s.size());
+            b.DEC();
+            return true;
+        }
+        else if (b.type == V_STRING)
+        {
+            string s;
+            a.ToString(s, programprintprefs);
+            s.append(b.sval->str(), b.sval->len);
+            res = NewString(s);
+            a.DEC();
+            b.DECRT();
+            return true;
+        }
         return false;
     }
 
@@ -1388,14 +1750,21 @@ struct VM : VMBase
     void IDXErr(int i, int n, const Value &v)                   { if (i < 0 || i >= n) Error(string("index ") + string(inttoa(i)) + " out of range " + string(inttoa(n)), v); }
     void VecType(const Value &vec)                              { if (vec.vval->type < 0) Error("cannot use field dereferencing on untyped vector", vec); }
 
-    bool AllInt(const LVector *v)
+    // Returns V_INT or V_FLOAT if all elements are of that type, V_ANY otherwise.
+    ValueType ElemType(const LVector *v)
     {
-        for (int i = 0; i < v->len; i++)
-            if (v->at(i).type != V_INT)
-                return false;
-        return true;
+        if (!v->len) return V_INT;
+        auto t = v->at(0).type;
+        if (t != V_INT && t != V_FLOAT) return V_ANY;
+        for (int i = 1; i < v->len; i++)
+            if (v->at(i).type != t)
+                return V_ANY;
+        return t;
     }
 
+    static float ScalarF(const Value &v) { return v.type == V_INT ? (float)v.ival : v.fval; }
+    static int   ScalarI(const Value &v) { return v.ival; }
+
     int GrabIndex(const Value &idx)
     {
         if (idx.type == V_INT) return idx.ival;
@@ -1427,7 +1796,15 @@ struct VM : VMBase
         return 0;
     }
 
-    int VectorLoop(const Value &a, const Value &b, Value &res, bool &isfloat)
+    bool AllOfType(LVector *v, ValueType t)
+    {
+        for (int i = 0; i < v->len; i++) if (v->at(i).type != t) return false;
+        return true;
+    }
+
+    // homogeneous is set when all elements and scalars are of the type indicated by isfloat (with int scalars
+    // allowed for float), so the caller can skip VectorElem.
+    int VectorLoop(const Value &a, const Value &b, Value &res, bool &isfloat, bool &homogeneous)
     {
         // note: not doing DEC() on the reused vectors is ok because VectorElem will error on not float/int
         int len;
@@ -1435,33 +1812,39 @@ struct VM : VMBase
         if (a.type == V_VECTOR)
         {
             len = a.vval->len;
+            auto ta = ElemType(a.vval);
             if (b.type == V_VECTOR)
             {
                 len = min(len, b.vval->len);
-                if (len && AllInt(a.vval) && AllInt(b.vval)) isfloat = false;
+                auto tb = ElemType(b.vval);
+                if (len && ta == V_INT && tb == V_INT) isfloat = false;
+                homogeneous = ta == tb && ta != V_ANY;
                 if(a.vval->len < b.vval->len || (a.vval->len == b.vval->len && a.vval->type >= 0))
                 {
-                    if (a.vval->refc == 1) { res = a; return len; } else type = a.vval->type;
+                    if (a.vval->Unique()) { res = a; return len; } else type = a.vval->type;
                 }
                 else
                 {
-                    if (b.vval->refc == 1) { res = b; return len; } else type = b.vval->type;
+                    if (b.vval->Unique()) { res = b; return len; } else type = b.vval->type;
                 }
             }
             else
             {
-                if (b.type == V_INT) { if (len && AllInt(a.vval)) isfloat = false; }
+                if (b.type == V_INT) { if (len && ta == V_INT) isfloat = false; homogeneous = ta != V_ANY; }
                 else if (b.type != V_FLOAT) return -1;
-                if (a.vval->refc == 1) { res = a; return len; }
+                else homogeneous = ta == V_FLOAT;
+                if (a.vval->Unique()) { res = a; return len; }
                 type = a.vval->type;
             }
         }
         else if (b.type == V_VECTOR)
         {
             len = b.vval->len;
-            if (a.type == V_INT) { if (len && AllInt(b.vval)) isfloat = false; }
-            else if (b.type != V_FLOAT) return -1;
-            if (b.vval->refc == 1) { res = b; return len; }
+            auto tb = ElemType(b.vval);
+            if (a.type == V_INT) { if (len && tb == V_INT) isfloat = false; homogeneous = tb != V_ANY; }
+            else if (a.type != V_FLOAT) return -1;
+            else homogeneous = tb == V_FLOAT;
+            if (b.vval->Unique()) { res = b; return len; }
             type = b.vval->type;
         }
         else
@@ -1526,8 +1909,10 @@ struct VM : VMBase
     int GC()    // shouldn't really be used, but just in case
     {
         for (int i = 0; i <= sp; i++) stack[i].Mark();
+        for (auto co = curcoroutine; co; co = co->parent) for (int i = 0; i <= co->sp; i++) co->stack[i].Mark();
         for (size_t i = 0; i < st.identtable.size(); i++) vars[i].Mark();
         vml.LogMark();
+        MarkInterned();
 
         vector<void *> objs;
         vector<void *> leaks;
@@ -1550,8 +1935,13 @@ struct VM : VMBase
             {
                 default: VMASSERT(ro->type >= 0);  // fall thru: a struct type
                 case V_VECTOR:    v.vval->len = 0; v.vval->deleteself(); break;
-                case V_STRING:                     v.sval->deleteself(); break;
+                case V_STRING:                     v.sval->deleteself(false); break;
                 case V_COROUTINE:                  v.cval->deleteself(false); break;
+                case V_BUFFER:                     v.bval->deleteself(); break;
+                case V_HASHMAP:                    v.hval->deleteself(false); break;
+                case V_PQUEUE:                     v.qval->deleteself(false); break;
+                case V_STRINGBUILDER:              v.sbval->deleteself(); break;
+                case V_PVECTOR:                    v.pvval->deleteself(false); break;
             }
         }
 
@@ -26,6 +26,11 @@ void Value::DECDELETE() const
         case V_VECTOR:    vval->deleteself();     break;
         case V_STRING:    sval->deleteself();     break;
         case V_COROUTINE: cval->deleteself(true); break;
+        case V_BUFFER:    bval->deleteself();     break;
+        case V_HASHMAP:   hval->deleteself(true); break;
+        case V_PQUEUE:    qval->deleteself(true); break;
+        case V_STRINGBUILDER: sbval->deleteself(); break;
+        case V_PVECTOR:   pvval->deleteself(true); break;
         default:          assert(0);
     }
 }
@@ -40,9 +45,14 @@ bool Value::Equal(const Value &o, bool structural) const
         case V_INT:         return ival == o.ival;
         case V_FLOAT:       return fval == o.fval;
 
-        case V_STRING:      return (*sval) == (*o.sval);
+        case V_STRING:      return sval == o.sval || (*sval) == (*o.sval);
         case V_VECTOR:      return vval == o.vval || (structural && vval->Equal(*o.vval));
         case V_COROUTINE:   return cval == o.cval;
+        case V_BUFFER:      return bval == o.bval || (structural && bval->Equal(*o.bval));
+        case V_HASHMAP:     return hval == o.hval || (structural && hval->Equal(*o.hval));
+        case V_PQUEUE:      return qval == o.qval;
+        case V_STRINGBUILDER: return sbval == o.sbval;
+        case V_PVECTOR:     return pvval == o.pvval || (structural && pvval->Equal(*o.pvval));
 
         case V_NIL:         return true;
         case V_FUNCTION:    return ip == o.ip;
@@ -51,21 +61,78 @@ bool Value::Equal(const Value &o, bool structural) const
     }
 }
 
+static uint HashMix(uint h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+uint Value::Hash() const
+{
+    switch (type)
+    {
+        case V_INT:       return HashMix((uint)ival);
+        case V_FLOAT:
+        {
+            if (fval == 0) return HashMix(0);   // -0.0 == 0.0
+            int2float i2f;
+            i2f.f = fval;
+            return HashMix((uint)i2f.i);
+        }
+        case V_STRING:    return sval->Hash();
+        case V_BUFFER:    return HashBytes(bval->bdata(), bval->bytes());
+        case V_VECTOR:
+        {
+            uint h = HashMix(vval->len);
+            for (int i = 0; i < vval->len; i++) h = h * 31 + vval->at(i).Hash();
+            return h;
+        }
+        case V_PVECTOR:
+        {
+            uint h = HashMix(pvval->len);
+            pvval->ForEach([&](const Value &v) { h = h * 31 + v.Hash(); });
+            return h;
+        }
+        case V_HASHMAP:   return HashMix(hval->len);    // content order dependent, so only the size
+        case V_FUNCTION:  return HashMix((uint)(size_t)ip);
+        case V_COROUTINE: return HashMix((uint)(size_t)cval);
+        case V_PQUEUE:    return HashMix((uint)(size_t)qval);
+        case V_STRINGBUILDER: return HashMix((uint)(size_t)sbval);
+        default:          return HashMix(type);
+    }
+}
+
 string Value::ToString(PrintPrefs &pp) const
+{
+    string sd;
+    ToString(sd, pp);
+    return sd;
+}
+
+void Value::ToString(string &sd, PrintPrefs &pp) const
 {
     switch (type)
     {
-        case V_INT:       return inttoa(ival);
-        case V_FLOAT:     return flttoa(fval, pp.decimals);
+        case V_INT:       sd += inttoa(ival); break;
+        case V_FLOAT:     sd += flttoa(fval, pp.decimals); break;
 
-        case V_STRING:    return sval->ToString(pp);
-        case V_VECTOR:    return vval->ToString(pp);
-        case V_COROUTINE: return "(coroutine)";
+        case V_STRING:    sval->ToString(sd, pp); break;
+        case V_VECTOR:    vval->ToString(sd, pp); break;
+        case V_COROUTINE: sd += "(coroutine)"; break;
+        case V_BUFFER:    bval->ToString(sd, pp); break;
+        case V_HASHMAP:   hval->ToString(sd, pp); break;
+        case V_PQUEUE:    sd += "(pqueue)"; break;
+        case V_STRINGBUILDER: sd += "(stringbuilder)"; break;
+        case V_PVECTOR:   pvval->ToString(sd, pp); break;
 
-        case V_NIL:       return "nil";
-        case V_FUNCTION:  return "<FUNCTION>";
-        case V_UNDEFINED: return "<UNDEFINED>";
-        default:            return string("<") + inttoa(type) + ">";
+        case V_NIL:       sd += "nil"; break;
+        case V_FUNCTION:  sd += "<FUNCTION>"; break;
+        case V_UNDEFINED: sd += "<UNDEFINED>"; break;
+        default:          sd += "<"; sd += inttoa(type); sd += ">"; break;
     }
 }
 
@@ -76,6 +143,11 @@ void Value::Mark()
         case V_STRING:    sval->Mark(); break; 
         case V_VECTOR:    vval->Mark(); break;
         case V_COROUTINE: cval->Mark(); break;
+        case V_BUFFER:    bval->Mark(); break;
+        case V_HASHMAP:   hval->Mark(); break;
+        case V_PQUEUE:    qval->Mark(); break;
+        case V_STRINGBUILDER: sbval->Mark(); break;
+        case V_PVECTOR:   pvval->Mark(); break;
         default:          break;
     }
 }
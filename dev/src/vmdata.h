@@ -18,7 +18,12 @@ namespace lobster {
 
 enum ValueType
 {
-    V_MINVMTYPES = -7,
+    V_MINVMTYPES = -12,
+    V_PVECTOR = -11,    // persistent vector, see LPVector
+    V_STRINGBUILDER = -10,
+    V_PQUEUE = -9,
+    V_HASHMAP = -8,
+    V_BUFFER = -7,      // packed numeric buffer, see LBuffer
     V_STRUCT = -6,      // [typechecker only] an alias for V_VECTOR
     V_CYCLEDONE = -5,
     V_VALUEBUF = -4,    // only used as memory type for vector/coro buffers, Value not allowed to refer to this
@@ -43,7 +48,7 @@ inline const char *BaseTypeName(ValueType t)
 {
     static const char *typenames[] =
     {
-        "struct", "<cycle>", "<value_buffer>", "coroutine", "string", "vector", 
+        "pvector", "stringbuilder", "pqueue", "hashmap", "buffer", "struct", "<cycle>", "<value_buffer>", "coroutine", "string", "vector", 
         "int", "float", "function", "nil", "undefined", "nilable", "any", "variable",
         "<retip>", "<funstart>", "<nargs>", "<deffun>", 
         "<logstart>", "<logend>", "<logmarker>", "<logfunwritestart>", "<logfunreadstart>"
@@ -56,7 +61,13 @@ inline const char *BaseTypeName(ValueType t)
 struct Value;
 struct LString;
 struct LVector;
+struct LBuffer;
+struct LHashMap;
+struct LPQueue;
+struct LStringBuilder;
+struct LPVector;
 struct CoRoutine;
+struct VarSnapshot;
 
 struct PrintPrefs
 {
@@ -73,10 +84,11 @@ struct PrintPrefs
 struct VMBase
 {
     PrintPrefs programprintprefs;
+    RandomNumberGenerator<MersenneTwister> rnd;     // per VM, so VMs on other threads don't share its state
 
     VMBase() : programprintprefs(10, 10000, false, -1) {}
 
-    //virtual Value EvalC(Value &cl, int nargs) = 0;
+    virtual Value EvalC(const Value &fun, int nargs) = 0;  // caller pushes nargs args first
     virtual Value BuiltinError(string err) = 0;
     virtual void BuiltinCheck(Value &v, ValueType desired, const char *name) = 0;
     virtual void Push(const Value &v) = 0;
@@ -84,6 +96,13 @@ struct VMBase
     virtual LString *NewString(const string &s) = 0;
     virtual LString *NewString(const char *c, int l) = 0;
     virtual LVector *NewVector(int n, int t) = 0;
+    virtual LBuffer *NewBuffer(int n, int et) = 0;
+    virtual LHashMap *NewHashMap(int reserve) = 0;
+    virtual LPQueue *NewPQueue() = 0;
+    virtual LStringBuilder *NewStringBuilder() = 0;
+    virtual LPVector *NewPVector() = 0;
+    virtual LString *Intern(LString *s) = 0;
+    virtual LString *SubString(LString *s, int start, int size) = 0;
     virtual int GetVectorType(int which) = 0;
     virtual void Trace(bool on) = 0;
     virtual float Time() = 0;
@@ -93,14 +112,21 @@ struct VMBase
     virtual string &ReverseLookupType(uint v) = 0;
     virtual void SetMaxStack(int ms) = 0;
     virtual void CoResume(CoRoutine *co) = 0;
+    // for schedule(): resumes co with ret as the value of its yield, and runs it until it yields again or finishes
+    virtual void CoRunUntilYield(CoRoutine *co, const Value &ret) = 0;
+    virtual void FreeCoStack(Value *stack, int size) = 0;
     virtual int CallerId() = 0;
     virtual const char *GetProgramName() = 0;
     virtual void LogFrame() = 0;
+    // for parallel_map(): copy all variables of this VM, then run f in a fresh VM on the current thread that shares
+    // this VM's program and starts out with those copies as its variables.
+    virtual void SnapshotVars(vector<VarSnapshot> &snap) = 0;
+    virtual void RunWorker(const vector<VarSnapshot> &snap, const function<void()> &f) = 0;
 };
 
 // the 2 globals that make up the current VM instance
-extern VMBase *g_vm;
-extern SlabAlloc *vmpool;
+extern THREAD_LOCAL VMBase *g_vm;        // the VM running on the current thread
+extern THREAD_LOCAL SlabAlloc *vmpool;
 
 struct DynAlloc     // ANY memory allocated by the VM must inherit from this, so we can identify leaked memory
 {
@@ -131,55 +157,120 @@ struct LenObj : RefObj
     LenObj(int _t, int _l) : RefObj(_t), len(_l) {}
 };
 
+inline uint HashBytes(const void *p, size_t len, uint h = 2166136261u)
+{
+    // FNV-1a
+    auto b = (const uchar *)p;
+    for (size_t i = 0; i < len; i++) h = (h ^ b[i]) * 16777619u;
+    return h;
+}
+
+#ifndef WIN32
+extern void UnmapString(LString *s);    // file.cpp
+#endif
+
 struct LString : LenObj
 {
-    LString(int _l) : LenObj(V_STRING, _l) {}
+    uint hash;          // 0 if not computed yet, reset when the string is modified in place
+    bool interned;      // there is exactly one interned string with this content, see VM::Intern
+    bool mapped;        // characters are a read-only memory mapped file, see read_file, not in vmpool
+    LString *base;      // if set, this is a view of the last len characters of base, which it holds a reference to
+
+    LString(int _l) : LenObj(V_STRING, _l), hash(0), interned(false), mapped(false), base(nullptr) {}
+
+    // Always 0 terminated: views only ever cover the end of their base.
+    char *str() { return base ? (char *)(base + 1) + base->len - len : (char *)(this + 1); }
 
-    char *str() { return (char *)(this + 1); }
+    // Bytes allocated for the characters of a string of length l, including the terminator. Longer strings round up
+    // to a power of 2, so appending to a string nobody else refers to can often happen in place (see VM::StrOps).
+    static int AllocSize(int l)
+    {
+        int n = l + 1;
+        if (n <= 128) return n;
+        int p = 256;
+        while (p < n) p *= 2;
+        return p;
+    }
+
+    int capacity() const { return base || mapped ? len : AllocSize(len) - 1; }
+
+    uint Hash()
+    {
+        if (!hash) hash = max(HashBytes(str(), len), 1u);
+        return hash;
+    }
 
-    string ToString(PrintPrefs &pp)
+    void ToString(string &sd, PrintPrefs &pp)
     {
         if (pp.cycles >= 0)
         {
-            if (type == V_CYCLEDONE) return CycleStr(); 
+            if (type == V_CYCLEDONE) { sd += CycleStr(); return; }
             CycleDone(pp.cycles);
         }
-        string s = len > pp.budget ? string(str()).substr(0, pp.budget) + ".." : str();
+        int l = min(len, max(pp.budget, 0));
         if (pp.quoted)
         {
-            string r = "\"";
-            for (size_t i = 0; i < s.length(); i++) switch(s[i])
+            sd += '\"';
+            auto s = str();
+            for (int i = 0; i < l; i++) switch(s[i])
             {
-                case '\n': r += "\\n"; break;
-                case '\t': r += "\\t"; break;
-                case '\r': r += "\\r"; break;
-                case '\\': r += "\\\\"; break;
-                case '\"': r += "\\\""; break;
-                case '\'': r += "\\\'"; break;
+                case '\n': sd += "\\n"; break;
+                case '\t': sd += "\\t"; break;
+                case '\r': sd += "\\r"; break;
+                case '\\': sd += "\\\\"; break;
+                case '\"': sd += "\\\""; break;
+                case '\'': sd += "\\\'"; break;
                 default:
-                    if (s[i] >= ' ' && s[i] <= '~') r += s[i];
-                    else { 
-                        r += "\\x"; r += HexChar(((uchar)s[i]) >> 4); r += HexChar(s[i] & 0xF); }
+                    if (s[i] >= ' ' && s[i] <= '~') sd += s[i];
+                    else {
+                        sd += "\\x"; sd += HexChar(((uchar)s[i]) >> 4); sd += HexChar(s[i] & 0xF); }
                     break;
             }
-
-            r += "\"";
-            return r; 
+            if (l < len) sd += "..";
+            sd += '\"';
         }
         else
         {
-            return s;
+            sd.append(str(), l);
+            if (l < len) sd += "..";
         }
     }
 
     char HexChar(char i) { return i + (i < 10 ? '0' : 'A' - 10); }
 
-    void Mark() { if (refc > 0) refc = -refc; }
+    void Mark()
+    {
+        // the GC only restores the refc of what is in vmpool
+        if (refc > 0 && !mapped) refc = -refc;
+        if (base) base->Mark();
+    }
 
-    void deleteself() { vmpool->dealloc(this, sizeof(LString) + len + 1); }
+    void deleteself(bool deref = true)
+    {
+        if (base)
+        {
+            if (deref && --base->refc <= 0) base->deleteself();
+            vmpool->dealloc(this, sizeof(LString));
+        }
+        #ifndef WIN32
+        else if (mapped)
+        {
+            UnmapString(this);
+        }
+        #endif
+        else
+        {
+            vmpool->dealloc(this, sizeof(LString) + AllocSize(len));
+        }
+    }
 
-    bool operator==(LString &o) { return strcmp(str(), o.str()) == 0; }
-    bool operator!=(LString &o) { return strcmp(str(), o.str()) != 0; }
+    bool operator==(LString &o)
+    {
+        if (this == &o) return true;
+        if (len != o.len || (interned && o.interned) || (hash && o.hash && hash != o.hash)) return false;
+        return memcmp(str(), o.str(), len) == 0;
+    }
+    bool operator!=(LString &o) { return !(*this == o); }
     bool operator< (LString &o) { return strcmp(str(), o.str()) <  0; }
     bool operator<=(LString &o) { return strcmp(str(), o.str()) <= 0; }
     bool operator> (LString &o) { return strcmp(str(), o.str()) >  0; }
@@ -197,6 +288,11 @@ struct Value
         LString *sval;
         LVector *vval;
         CoRoutine *cval;
+        LBuffer *bval;
+        LHashMap *hval;
+        LPQueue *qval;
+        LStringBuilder *sbval;
+        LPVector *pvval;
         LenObj *lobj;
         RefObj *ref;
         int *ip;        // FAKE_COCLOSURE_ADDRESS means its a coroutine yield
@@ -214,6 +310,11 @@ struct Value
     inline Value(int *i, ValueType t) : type(t),           ip(i)   {}
     inline Value(LVector *v)          : type(V_VECTOR),    vval(v) {}
     inline Value(CoRoutine *c)        : type(V_COROUTINE), cval(c) {}
+    inline Value(LBuffer *b)          : type(V_BUFFER),    bval(b) {}
+    inline Value(LHashMap *h)         : type(V_HASHMAP),   hval(h) {}
+    inline Value(LPQueue *q)          : type(V_PQUEUE),    qval(q) {}
+    inline Value(LStringBuilder *sb)  : type(V_STRINGBUILDER), sbval(sb) {}
+    inline Value(LPVector *pv)        : type(V_PVECTOR),   pvval(pv) {}
     inline Value(RefObj *r)           : type(r->type >= 0 ? V_VECTOR : (ValueType)r->type), ref(r) {}
 
     inline bool True() const { return ival != 0; } // FIXME: not safe on 64bit systems unless we make ival 64bit also
@@ -255,11 +356,25 @@ struct Value
     void DECDELETE() const;
 
     bool Equal(const Value &o, bool structural) const;
+    uint Hash() const;   // consistent with structural Equal
 
     string ToString(PrintPrefs &pp) const;
+    void ToString(string &sd, PrintPrefs &pp) const;    // appends to sd
     void Mark();
 };
 
+// For passing values between VMs that don't share a heap (see serialize.cpp). Sharing is preserved.
+// Both throw a string on error.
+extern string SerializeValue(const Value &v);
+extern Value DeserializeValue(const string &s);
+
+struct VarSnapshot
+{
+    int idx;
+    Value scalar;   // if not a reference
+    string data;    // otherwise serialized, never empty
+};
+
 struct ValueRef
 {
     const Value &v;
@@ -268,21 +383,24 @@ struct ValueRef
     ~ValueRef() { v.DEC(); }
 };
 
+// DynAlloc header followed by the number of vectors sharing the buffer, padded to pointer size if needed
+const size_t SUBBUFHEADER = sizeof(int) * 2 > sizeof(void *) ? sizeof(int) * 2 : sizeof(void *);
+
 inline Value *AllocSubBuf(size_t size)
 {
-    auto mem = (void **)vmpool->alloc(size * sizeof(Value) + sizeof(void *));
-    *((int *)mem) = V_VALUEBUF;    // DynAlloc header, padded to pointer size if needed
-    mem++;
-    return (Value *)mem;
+    auto mem = (int *)vmpool->alloc(size * sizeof(Value) + SUBBUFHEADER);
+    mem[0] = V_VALUEBUF;
+    mem[1] = 1;
+    return (Value *)((char *)mem + SUBBUFHEADER);
 }
 
 inline void DeallocSubBuf(Value *v, size_t size)
 {
-    auto mem = (void **)v;
-    mem--;
-    vmpool->dealloc(mem, size * sizeof(Value) + sizeof(void *));
+    vmpool->dealloc((char *)v - SUBBUFHEADER, size * sizeof(Value) + SUBBUFHEADER);
 }
 
+inline int &SubBufSharers(Value *v) { return ((int *)((char *)v - SUBBUFHEADER))[1]; }
+
 struct LVector : LenObj
 {
     private:
@@ -299,6 +417,31 @@ struct LVector : LenObj
 
     ~LVector() { assert(0); }   // destructed by DECREF
 
+    // Vectors made by copy() share their element buffer (which then holds the references to the elements) until one
+    // of them is modified. Anything that writes to a vector must call Unshare() first, at() can't check for you.
+    bool Shared() const { return v != (Value *)(this + 1) && SubBufSharers(v) > 1; }
+
+    // safe to modify in place without anyone noticing
+    bool Unique() const { return refc == 1 && !Shared(); }
+
+    void Unshare()
+    {
+        if (Shared()) resize(maxl);
+    }
+
+    // makes this (empty) vector a copy of from, sharing its buffer
+    void ShareBuf(LVector *from)
+    {
+        assert(!len);
+        if (!from->len) return;
+        if (from->v == (Value *)(from + 1)) from->resize(from->maxl);   // inline buffers can't outlive their owner
+        deallocbuf();
+        v = from->v;
+        maxl = from->maxl;
+        len = from->len;
+        SubBufSharers(v)++;
+    }
+
     void deallocbuf()
     {
         if (v == (Value *)(this + 1)) return;
@@ -307,8 +450,8 @@ struct LVector : LenObj
 
     void deleteself()
     {
-        DeRef();
-        deallocbuf();
+        if (Shared()) SubBufSharers(v)--;
+        else { DeRef(); deallocbuf(); }
         vmpool->dealloc(this, sizeof(LVector) + sizeof(Value) * initiallen);
     }
 
@@ -317,7 +460,16 @@ struct LVector : LenObj
         // FIXME: check overflow
         auto mem = AllocSubBuf(newmax);
         if (len) memcpy(mem, v, sizeof(Value) * len);
-        deallocbuf();
+        if (Shared())
+        {
+            // leave the old buffer to the other vectors, and take our own references
+            SubBufSharers(v)--;
+            for (int i = 0; i < len; i++) mem[i].INC();
+        }
+        else
+        {
+            deallocbuf();
+        }
         maxl = newmax;
         v = (Value *)mem;
     }
@@ -325,11 +477,13 @@ struct LVector : LenObj
     void push(const Value &val)
     {
         if (len == maxl) resize(maxl ? maxl * 2 : 4);
+        else Unshare();
         v[len++] = val;
     }
 
     Value pop()
     {
+        Unshare();
         return v[--len];
     }
 
@@ -342,6 +496,7 @@ struct LVector : LenObj
     {
         assert(n > 0 && i >= 0 && i <= len); // note: insertion right at the end is legal, hence <= 
         if (len + n > maxl) resize(max(len + n, maxl ? maxl * 2 : 4));   
+        else Unshare();
         memmove(v + i + n, v + i, sizeof(Value) * (len - i));
         len++;
         for (int j = 0; j < n; j++) v[i + j] = val;
@@ -351,6 +506,7 @@ struct LVector : LenObj
     Value remove(int i, int n)
     { 
         assert(n >= 0 && n <= len && i >= 0 && i <= len - n);
+        Unshare();
         auto x = v[i];
         for (int j = 1; j < n; j++) v[i + j].DEC();
         memmove(v + i, v + i + n, sizeof(Value) * (len - i - n));
@@ -367,34 +523,37 @@ struct LVector : LenObj
     void append(LVector *from, int start, int amount)
     {
         if (len + amount > maxl) resize(len + amount);  // FIXME: check overflow
+        else Unshare();
         memcpy(v + len, from->v + start, sizeof(Value) * amount);
         for (int i = 0; i < amount; i++) v[len + i].INC();
         len += amount;
     }
 
-    string ToString(PrintPrefs &pp)
+    void ToString(string &sd, PrintPrefs &pp)
     {
         if (pp.cycles >= 0)
         {
-            if (type == V_CYCLEDONE) return CycleStr(); 
+            if (type == V_CYCLEDONE) { sd += CycleStr(); return; }
             CycleDone(pp.cycles);
         }
 
-        string s = "[";
+        auto start = sd.size();
+        sd += "[";
         for (int i = 0; i < len; i++)
         {
-            if (i) s += ", ";
-            if ((int)s.size() > pp.budget) { s += "...."; break; }
-            PrintPrefs subpp(pp.depth - 1, pp.budget - s.size(), true, pp.decimals);
-            s += pp.depth || v[i].type >= 0 ? v[i].ToString(subpp) : "..";
+            if (i) sd += ", ";
+            int used = (int)(sd.size() - start);
+            if (used > pp.budget) { sd += "...."; break; }
+            PrintPrefs subpp(pp.depth - 1, pp.budget - used, true, pp.decimals);
+            if (pp.depth || v[i].type >= 0) v[i].ToString(sd, subpp); else sd += "..";
         }
-        s += "]";
-        if (type >= 0) s += ":" + g_vm->ReverseLookupType(type);
-        return s;
+        sd += "]";
+        if (type >= 0) { sd += ":"; sd += g_vm->ReverseLookupType(type); }
     }
 
     bool Equal(LVector &o)
     {
+        if (len != o.len) return false;
         for (int i = 0; i < len; i++) if (!v[i].Equal(o.v[i], true)) return false;
         return true;
     }
@@ -412,39 +571,776 @@ struct LVector : LenObj
     }
 };
 
+enum BufferElem
+{
+    BE_FLOAT,   // float32
+    BE_INT,     // int32
+    BE_BYTE,    // uint8
+};
+
+// A flat array of numbers of a single element type, stored inline after the object like LString.
+// Unlike LVector there is no per element Value (and no per element type tag), so this is 4x (or 8x for bytes)
+// smaller, and can be handed to graphics/physics/file code as-is.
+struct LBuffer : LenObj
+{
+    int elemtype;
+
+    LBuffer(int _l, int _et) : LenObj(V_BUFFER, _l), elemtype(_et) {}
+
+    static int ElemSize(int et) { return et == BE_BYTE ? 1 : 4; }
+    static const char *ElemName(int et) { return et == BE_FLOAT ? "float" : (et == BE_INT ? "int" : "byte"); }
+
+    int bytes() const { return len * ElemSize(elemtype); }
+
+    float *fdata() { return (float *)(this + 1); }
+    int   *idata() { return (int   *)(this + 1); }
+    uchar *bdata() { return (uchar *)(this + 1); }
+
+    Value at(int i)
+    {
+        assert(i >= 0 && i < len);
+        switch (elemtype)
+        {
+            case BE_FLOAT: return Value(fdata()[i]);
+            case BE_INT:   return Value(idata()[i]);
+            default:       return Value((int)bdata()[i]);
+        }
+    }
+
+    float atf(int i)
+    {
+        assert(i >= 0 && i < len);
+        switch (elemtype)
+        {
+            case BE_FLOAT: return fdata()[i];
+            case BE_INT:   return (float)idata()[i];
+            default:       return (float)bdata()[i];
+        }
+    }
+
+    // caller ensures v is V_INT or V_FLOAT
+    void set(int i, const Value &v)
+    {
+        assert(i >= 0 && i < len);
+        switch (elemtype)
+        {
+            case BE_FLOAT: fdata()[i] = v.type == V_FLOAT ? v.fval : (float)v.ival; break;
+            case BE_INT:   idata()[i] = v.type == V_INT ? v.ival : (int)v.fval; break;
+            default:       bdata()[i] = (uchar)(v.type == V_INT ? v.ival : (int)v.fval); break;
+        }
+    }
+
+    void ToString(string &sd, PrintPrefs &pp)
+    {
+        auto start = sd.size();
+        sd += "(buffer:";
+        sd += ElemName(elemtype);
+        sd += " [";
+        for (int i = 0; i < len; i++)
+        {
+            if (i) sd += ", ";
+            if ((int)(sd.size() - start) > pp.budget) { sd += "...."; break; }
+            at(i).ToString(sd, pp);
+        }
+        sd += "])";
+    }
+
+    void Mark() { if (refc > 0) refc = -refc; }
+
+    void deleteself() { vmpool->dealloc(this, sizeof(LBuffer) + bytes()); }
+
+    bool Equal(LBuffer &o)
+    {
+        return elemtype == o.elemtype && len == o.len && !memcmp(this + 1, &o + 1, bytes());
+    }
+};
+
+// Open addressing (linear probing) hash table, with the hash of each key cached in its slot so probing and resizing
+// don't need to rehash or compare keys unless the hashes match.
+// Keys are compared structurally, so modifying a vector after using it as a key will make it unfindable.
+struct LHashMap : LenObj
+{
+    struct Slot
+    {
+        uint hash;  // EMPTY, TOMBSTONE, or the hash of key
+        Value key;
+        Value val;
+    };
+
+    enum { EMPTY = 0, TOMBSTONE = 1 };
+
+    Slot *slots;
+    int cap;        // always a power of 2, or 0
+    int used;       // len + tombstones
+
+    LHashMap() : LenObj(V_HASHMAP, 0), slots(nullptr), cap(0), used(0) {}
+
+    static uint Hash(const Value &key)
+    {
+        uint h = key.Hash();
+        return h < 2 ? h + 2 : h;
+    }
+
+    static Slot *AllocSlots(int n)
+    {
+        auto mem = (void **)vmpool->alloc(n * sizeof(Slot) + sizeof(void *));
+        *((int *)mem) = V_VALUEBUF;    // same type tag as AllocSubBuf
+        auto slots = (Slot *)(mem + 1);
+        for (int i = 0; i < n; i++) new (slots + i) Slot();     // hash 0 is EMPTY
+        return slots;
+    }
+
+    void deallocslots()
+    {
+        if (slots) vmpool->dealloc((void **)slots - 1, cap * sizeof(Slot) + sizeof(void *));
+    }
+
+    // returns the slot holding key, or the slot it should be inserted in if not present (never nullptr if cap > 0)
+    Slot *Find(const Value &key, uint h)
+    {
+        Slot *ins = nullptr;
+        for (int i = h & (cap - 1); ; i = (i + 1) & (cap - 1))
+        {
+            auto &s = slots[i];
+            if (s.hash == EMPTY) return ins ? ins : &s;
+            if (s.hash == TOMBSTONE) { if (!ins) ins = &s; }
+            else if (s.hash == h && s.key.Equal(key, true)) return &s;
+        }
+    }
+
+    Value *Get(const Value &key)
+    {
+        if (!len) return nullptr;
+        auto s = Find(key, Hash(key));
+        return s->hash > TOMBSTONE ? &s->val : nullptr;
+    }
+
+    void Rehash(int newcap)
+    {
+        auto old = slots;
+        int oldcap = cap;
+        slots = AllocSlots(newcap);
+        cap = newcap;
+        used = len;
+        for (int i = 0; i < oldcap; i++) if (old[i].hash > TOMBSTONE) *Find(old[i].key, old[i].hash) = old[i];
+        if (old) vmpool->dealloc((void **)old - 1, oldcap * sizeof(Slot) + sizeof(void *));
+    }
+
+    void Reserve(int n)
+    {
+        int newcap = 8;
+        while (newcap * 3 < n * 4) newcap *= 2;
+        if (newcap > cap) Rehash(newcap);
+    }
+
+    // takes ownership of both key and val
+    void Set(const Value &key, const Value &val)
+    {
+        if ((used + 1) * 4 > cap * 3)
+        {
+            // grow to at most half full, or just clean out tombstones if that is enough
+            int newcap = cap ? cap : 8;
+            while ((len + 1) * 2 > newcap) newcap *= 2;
+            Rehash(newcap);
+        }
+        uint h = Hash(key);
+        auto s = Find(key, h);
+        if (s->hash > TOMBSTONE)
+        {
+            key.DEC();
+            s->val.DEC();
+            s->val = val;
+            return;
+        }
+        if (s->hash == EMPTY) used++;
+        s->hash = h;
+        s->key = key;
+        s->val = val;
+        len++;
+    }
+
+    // returns false if not present, otherwise the caller owns the returned value
+    bool Remove(const Value &key, Value &val)
+    {
+        if (!len) return false;
+        auto s = Find(key, Hash(key));
+        if (s->hash <= TOMBSTONE) return false;
+        s->hash = TOMBSTONE;
+        s->key.DEC();
+        val = s->val;
+        len--;
+        return true;
+    }
+
+    void Clear()
+    {
+        DeRef();
+        for (int i = 0; i < cap; i++) slots[i] = Slot();
+        len = used = 0;
+    }
+
+    void DeRef()
+    {
+        for (int i = 0; i < cap; i++) if (slots[i].hash > TOMBSTONE) { slots[i].key.DEC(); slots[i].val.DEC(); }
+    }
+
+    void deleteself(bool deref)
+    {
+        if (deref) DeRef();
+        deallocslots();
+        vmpool->dealloc(this, sizeof(LHashMap));
+    }
+
+    void ToString(string &sd, PrintPrefs &pp)
+    {
+        if (pp.cycles >= 0)
+        {
+            if (type == V_CYCLEDONE) { sd += CycleStr(); return; }
+            CycleDone(pp.cycles);
+        }
+
+        auto start = sd.size();
+        sd += "[";
+        bool first = true;
+        for (int i = 0; i < cap; i++) if (slots[i].hash > TOMBSTONE)
+        {
+            if (!first) sd += ", ";
+            first = false;
+            int used = (int)(sd.size() - start);
+            if (used > pp.budget) { sd += "...."; break; }
+            PrintPrefs subpp(pp.depth - 1, pp.budget - used, true, pp.decimals);
+            slots[i].key.ToString(sd, subpp);
+            sd += ": ";
+            if (pp.depth || slots[i].val.type >= 0) slots[i].val.ToString(sd, subpp); else sd += "..";
+        }
+        sd += "]:hashmap";
+    }
+
+    bool Equal(LHashMap &o)
+    {
+        if (len != o.len) return false;
+        for (int i = 0; i < cap; i++) if (slots[i].hash > TOMBSTONE)
+        {
+            auto v = o.Get(slots[i].key);
+            if (!v || !slots[i].val.Equal(*v, true)) return false;
+        }
+        return true;
+    }
+
+    void Mark()
+    {
+        if (refc < 0) return;
+        refc = -refc;
+        for (int i = 0; i < cap; i++) if (slots[i].hash > TOMBSTONE) { slots[i].key.Mark(); slots[i].val.Mark(); }
+    }
+};
+
+// Binary min-heap of items keyed by a float priority, with a secondary float priority to break ties, and after that
+// first-in-first-out. Pushing returns a handle that can be used to change the priority of an item while it is in the
+// queue (decrease-key), handles are reused once their item has left the queue.
+struct LPQueue : RefObj
+{
+    struct Entry
+    {
+        float pri, pri2;
+        int seq;
+        int handle;
+        Value item;
+
+        bool operator<(const Entry &o) const
+        {
+            return pri < o.pri || (pri == o.pri && (pri2 < o.pri2 || (pri2 == o.pri2 && seq < o.seq)));
+        }
+    };
+
+    vector<Entry> heap;
+    vector<int> pos;            // handle -> index in heap, or -1
+    vector<int> freehandles;
+    int nextseq;
+
+    LPQueue() : RefObj(V_PQUEUE), nextseq(0) {}
+
+    int size() const { return (int)heap.size(); }
+
+    bool Contains(int handle) const
+    {
+        return handle >= 0 && handle < (int)pos.size() && pos[handle] >= 0;
+    }
+
+    void Place(int i, const Entry &e) { heap[i] = e; pos[e.handle] = i; }
+
+    void SiftUp(int i)
+    {
+        auto e = heap[i];
+        while (i)
+        {
+            int p = (i - 1) / 2;
+            if (!(e < heap[p])) break;
+            Place(i, heap[p]);
+            i = p;
+        }
+        Place(i, e);
+    }
+
+    void SiftDown(int i)
+    {
+        auto e = heap[i];
+        int n = size();
+        for (;;)
+        {
+            int c = i * 2 + 1;
+            if (c >= n) break;
+            if (c + 1 < n && heap[c + 1] < heap[c]) c++;
+            if (!(heap[c] < e)) break;
+            Place(i, heap[c]);
+            i = c;
+        }
+        Place(i, e);
+    }
+
+    // takes ownership of item
+    int Push(const Value &item, float pri, float pri2)
+    {
+        int handle;
+        if (freehandles.empty()) { handle = (int)pos.size(); pos.push_back(-1); }
+        else { handle = freehandles.back(); freehandles.pop_back(); }
+        Entry e = { pri, pri2, nextseq++, handle, item };
+        heap.push_back(e);
+        SiftUp(size() - 1);
+        return handle;
+    }
+
+    void Update(int handle, float pri, float pri2)
+    {
+        assert(Contains(handle));
+        int i = pos[handle];
+        auto &e = heap[i];
+        bool up = pri < e.pri || (pri == e.pri && pri2 < e.pri2);
+        e.pri = pri;
+        e.pri2 = pri2;
+        if (up) SiftUp(i); else SiftDown(i);
+    }
+
+    // caller takes ownership of the returned item
+    Value Remove(int handle)
+    {
+        assert(Contains(handle));
+        int i = pos[handle];
+        auto item = heap[i].item;
+        pos[handle] = -1;
+        freehandles.push_back(handle);
+        auto last = heap.back();
+        heap.pop_back();
+        if (i < size())
+        {
+            bool up = last < heap[i];
+            Place(i, last);
+            if (up) SiftUp(i); else SiftDown(i);
+        }
+        return item;
+    }
+
+    void deleteself(bool deref)
+    {
+        if (deref) for (auto &e : heap) e.item.DEC();
+        this->~LPQueue();
+        vmpool->dealloc(this, sizeof(LPQueue));
+    }
+
+    void Mark()
+    {
+        if (refc < 0) return;
+        refc = -refc;
+        for (auto &e : heap) e.item.Mark();
+    }
+};
+
+// Accumulates a string in place, for building up output piece by piece.
+struct LStringBuilder : RefObj
+{
+    string buf;
+
+    LStringBuilder() : RefObj(V_STRINGBUILDER) {}
+
+    void deleteself()
+    {
+        this->~LStringBuilder();
+        vmpool->dealloc(this, sizeof(LStringBuilder));
+    }
+
+    void Mark() { if (refc > 0) refc = -refc; }
+};
+
+// Node of a persistent vector: either a leaf holding WIDTH elements, or an inner node holding WIDTH children one
+// level down. Nodes are shared between versions and refcounted, their type is V_VALUEBUF so the GC skips them, the
+// owning LPVector marks and frees them. Whether a node is a leaf follows from its level (0), and is not stored.
+struct PVNode : DynAlloc
+{
+    enum { BITS = 5, WIDTH = 1 << BITS, MASK = WIDTH - 1 };
+
+    int refc;
+
+    PVNode() : DynAlloc(V_VALUEBUF), refc(1) {}
+
+    Value *vals() { return (Value *)(this + 1); }
+    PVNode **kids() { return (PVNode **)(this + 1); }
+
+    static size_t Size(bool leaf) { return sizeof(PVNode) + WIDTH * (leaf ? sizeof(Value) : sizeof(PVNode *)); }
+
+    static PVNode *New(bool leaf)
+    {
+        auto n = new (vmpool->alloc(Size(leaf))) PVNode();
+        if (leaf) for (int i = 0; i < WIDTH; i++) n->vals()[i] = Value();
+        else memset(n->kids(), 0, WIDTH * sizeof(PVNode *));
+        return n;
+    }
+
+    // the copy holds its own references to everything this node refers to
+    PVNode *Copy(bool leaf)
+    {
+        auto n = new (vmpool->alloc(Size(leaf))) PVNode();
+        if (leaf) for (int i = 0; i < WIDTH; i++) n->vals()[i] = Value(vals()[i]).INC();
+        else for (int i = 0; i < WIDTH; i++) if ((n->kids()[i] = kids()[i])) n->kids()[i]->refc++;
+        return n;
+    }
+
+    // drops a reference that is known not to be the last one
+    void Unref() { assert(refc > 1); refc--; }
+
+    void Release(int level, bool deref)
+    {
+        if (--refc) return;
+        if (level) { for (int i = 0; i < WIDTH; i++) if (kids()[i]) kids()[i]->Release(level - BITS, deref); }
+        else if (deref) for (int i = 0; i < WIDTH; i++) vals()[i].DEC();
+        vmpool->dealloc(this, Size(!level));
+    }
+
+    void MarkElems(int level)
+    {
+        if (level) { for (int i = 0; i < WIDTH; i++) if (kids()[i]) kids()[i]->MarkElems(level - BITS); }
+        else for (int i = 0; i < WIDTH; i++) vals()[i].Mark();
+    }
+
+    static PVNode *NewPath(int level, PVNode *leaf)
+    {
+        if (!level) return leaf;
+        auto n = New(false);
+        n->kids()[0] = NewPath(level - BITS, leaf);
+        return n;
+    }
+};
+
+// Immutable vector (a 32-way trie, as in Clojure), for keeping many versions of a large vector around cheaply.
+// Elements are stored in the tree, except for the last (up to) 32 which are in a separate tail leaf, so pushes mostly
+// only copy the tail. Set/Push/Pop return a new version in O(log32 n), copying only the path to the changed element,
+// and leave this one untouched.
+struct LPVector : LenObj
+{
+    int shift;          // level of the root: elements are indexed by successive groups of BITS from this bit down
+    PVNode *root;       // nullptr when all elements fit in the tail
+    PVNode *tail;       // nullptr when empty
+
+    LPVector() : LenObj(V_PVECTOR, 0), shift(PVNode::BITS), root(nullptr), tail(nullptr) {}
+
+    int TailOff() const { return len <= PVNode::WIDTH ? 0 : ((len - 1) >> PVNode::BITS) << PVNode::BITS; }
+
+    PVNode *Leaf(int i)
+    {
+        if (i >= TailOff()) return tail;
+        auto n = root;
+        for (int level = shift; level; level -= PVNode::BITS) n = n->kids()[(i >> level) & PVNode::MASK];
+        return n;
+    }
+
+    Value &at(int i)
+    {
+        assert(i >= 0 && i < len);
+        return Leaf(i)->vals()[i & PVNode::MASK];
+    }
+
+    LPVector *Clone(int nlen)
+    {
+        auto pv = g_vm->NewPVector();
+        pv->len = nlen;
+        pv->shift = shift;
+        pv->root = root;
+        pv->tail = tail;
+        if (root) root->refc++;
+        if (tail) tail->refc++;
+        return pv;
+    }
+
+    // takes ownership of x
+    LPVector *Set(int i, const Value &x)
+    {
+        assert(i >= 0 && i < len);
+        auto pv = Clone(len);
+        if (i >= TailOff())
+        {
+            pv->tail->Unref();
+            pv->tail = SetIn(tail, 0, i, x);
+        }
+        else
+        {
+            pv->root->Unref();
+            pv->root = SetIn(root, shift, i, x);
+        }
+        return pv;
+    }
+
+    static PVNode *SetIn(PVNode *n, int level, int i, const Value &x)
+    {
+        auto c = n->Copy(!level);
+        if (level)
+        {
+            auto &k = c->kids()[(i >> level) & PVNode::MASK];
+            k->Unref();
+            k = SetIn(k, level - PVNode::BITS, i, x);
+        }
+        else
+        {
+            auto &v = c->vals()[i & PVNode::MASK];
+            v.DEC();
+            v = x;
+        }
+        return c;
+    }
+
+    // takes ownership of x
+    LPVector *Push(const Value &x)
+    {
+        auto pv = Clone(len + 1);
+        int intail = len - TailOff();
+        if (intail < PVNode::WIDTH)
+        {
+            if (tail) pv->tail->Unref();
+            pv->tail = tail ? tail->Copy(true) : PVNode::New(true);
+            pv->tail->vals()[intail] = x;
+            return pv;
+        }
+        // tail is full: it becomes a leaf of the tree (shared with this version), and x starts a new tail
+        tail->refc++;
+        pv->tail->Unref();
+        if ((len >> PVNode::BITS) > (1 << shift))
+        {
+            auto nroot = PVNode::New(false);
+            nroot->kids()[0] = root;    // reference taken over from Clone
+            nroot->kids()[1] = PVNode::NewPath(shift, tail);
+            pv->root = nroot;
+            pv->shift += PVNode::BITS;
+        }
+        else
+        {
+            if (root) pv->root->Unref();
+            pv->root = PushTail(shift, root);
+        }
+        pv->tail = PVNode::New(true);
+        pv->tail->vals()[0] = x;
+        return pv;
+    }
+
+    PVNode *PushTail(int level, PVNode *n)
+    {
+        int sub = ((len - 1) >> level) & PVNode::MASK;
+        auto c = n ? n->Copy(false) : PVNode::New(false);
+        auto &k = c->kids()[sub];
+        if (level == PVNode::BITS)
+        {
+            k = tail;
+        }
+        else if (k)
+        {
+            k->Unref();
+            k = PushTail(level - PVNode::BITS, k);
+        }
+        else
+        {
+            k = PVNode::NewPath(level - PVNode::BITS, tail);
+        }
+        return c;
+    }
+
+    LPVector *Pop()
+    {
+        assert(len);
+        if (len == 1) return g_vm->NewPVector();
+        auto pv = Clone(len - 1);
+        int intail = len - TailOff();
+        if (intail > 1)
+        {
+            pv->tail->Unref();
+            pv->tail = tail->Copy(true);
+            auto &v = pv->tail->vals()[intail - 1];
+            v.DEC();
+            v = Value();
+            return pv;
+        }
+        // the tail becomes empty: the last leaf of the tree moves out to become the new tail
+        pv->tail->Unref();
+        pv->tail = Leaf(len - 2);
+        pv->tail->refc++;
+        pv->root->Unref();
+        pv->root = PopTail(shift, root);
+        if (pv->root && shift > PVNode::BITS && !pv->root->kids()[1])
+        {
+            auto r = pv->root->kids()[0];
+            r->refc++;
+            pv->root->Release(shift, true);
+            pv->root = r;
+            pv->shift -= PVNode::BITS;
+        }
+        if (!pv->root) pv->shift = PVNode::BITS;
+        return pv;
+    }
+
+    PVNode *PopTail(int level, PVNode *n)
+    {
+        int sub = ((len - 2) >> level) & PVNode::MASK;
+        PVNode *nk = nullptr;
+        if (level > PVNode::BITS)
+        {
+            nk = PopTail(level - PVNode::BITS, n->kids()[sub]);
+            if (!nk && !sub) return nullptr;
+        }
+        else if (!sub) return nullptr;
+        auto c = n->Copy(false);
+        c->kids()[sub]->Unref();
+        c->kids()[sub] = nk;
+        return c;
+    }
+
+    // builds the tree bottom up, rather than pushing one by one
+    void FromVector(LVector *vec)
+    {
+        assert(!len);
+        len = vec->len;
+        if (!len) return;
+        int tailoff = TailOff();
+        vector<PVNode *> level;
+        for (int i = 0; i < len; i += PVNode::WIDTH)
+        {
+            auto n = PVNode::New(true);
+            for (int j = i; j < min(len, i + PVNode::WIDTH); j++) n->vals()[j - i] = vec->at(j).INC();
+            if (i < tailoff) level.push_back(n); else tail = n;
+        }
+        if (level.empty()) return;
+        shift = 0;
+        do
+        {
+            vector<PVNode *> up;
+            for (size_t i = 0; i < level.size(); i++)
+            {
+                if (i % PVNode::WIDTH == 0) up.push_back(PVNode::New(false));
+                up.back()->kids()[i % PVNode::WIDTH] = level[i];
+            }
+            level.swap(up);
+            shift += PVNode::BITS;
+        }
+        while (level.size() > 1);
+        root = level[0];
+    }
+
+    template<typename F> void ForEach(F f)
+    {
+        for (int i = 0; i < len; i += PVNode::WIDTH)
+        {
+            auto vals = Leaf(i)->vals();
+            for (int j = i; j < min(len, i + PVNode::WIDTH); j++) f(vals[j - i]);
+        }
+    }
+
+    void deleteself(bool deref)
+    {
+        if (root) root->Release(shift, deref);
+        if (tail) tail->Release(0, deref);
+        vmpool->dealloc(this, sizeof(LPVector));
+    }
+
+    void ToString(string &sd, PrintPrefs &pp)
+    {
+        if (pp.cycles >= 0)
+        {
+            if (type == V_CYCLEDONE) { sd += CycleStr(); return; }
+            CycleDone(pp.cycles);
+        }
+
+        auto start = sd.size();
+        sd += "[";
+        for (int i = 0; i < len; i++)
+        {
+            if (i) sd += ", ";
+            int used = (int)(sd.size() - start);
+            if (used > pp.budget) { sd += "...."; break; }
+            PrintPrefs subpp(pp.depth - 1, pp.budget - used, true, pp.decimals);
+            auto &v = at(i);
+            if (pp.depth || v.type >= 0) v.ToString(sd, subpp); else sd += "..";
+        }
+        sd += "]:pvector";
+    }
+
+    bool Equal(LPVector &o)
+    {
+        if (len != o.len) return false;
+        for (int i = 0; i < len; i++) if (!at(i).Equal(o.at(i), true)) return false;
+        return true;
+    }
+
+    void Mark()
+    {
+        if (refc < 0) return;
+        refc = -refc;
+        if (root) root->MarkElems(shift);
+        if (tail) tail->MarkElems(0);
+    }
+};
+
 struct CoRoutine : RefObj
 {
     bool active;        // goes to false when it has hit the end of the coroutine instead of a yield
-    int stackstart;     // when currently running, otherwise -1
-    Value *stackcopy;
-    size_t stackcopylen, stackcopymax;
+    bool running;       // resumed, and not yielded yet (it or any coroutine it resumed is executing)
+    // The coroutine's own stack while suspended, and while running the stack of whoever resumed it: the VM swaps
+    // its stack with these, so yield and resume cost the same regardless of how deep either stack is.
+    Value *stack;
+    int stacksize;
+    int sp;
+    Value *varbackup;   // values of the vars in varip: its own while suspended, the parent's while running
+    Value result;       // once finished, the value it returned: its stack has gone back to the VM by then
     int *returnip;
-    int *varip;
+    int *varip;         // count, then the ident idx for each slot (see CodeGen::AssignCoroutineSlots), -1 if unused
     CoRoutine *parent;
 
-    CoRoutine(int _ss, int *_rip, int *_vip, CoRoutine *_p)
-        : RefObj(V_COROUTINE), active(true), stackstart(_ss), stackcopy(nullptr), stackcopylen(0), stackcopymax(0),
-          returnip(_rip), varip(_vip), parent(_p) {}
+    CoRoutine(int *_rip, int *_vip, CoRoutine *_p, Value *_stack, int _stacksize)
+        : RefObj(V_COROUTINE), active(true), running(true), stack(_stack), stacksize(_stacksize),
+          sp(-1), varbackup(AllocSubBuf(*_vip)), result(0, V_NIL), returnip(_rip), varip(_vip), parent(_p) {}
 
     Value &Current()
     {
-        if (stackstart >= 0) g_vm->BuiltinError("cannot get value of active coroutine");
-        return stackcopy[stackcopylen - 1];
+        if (running) g_vm->BuiltinError("cannot get value of active coroutine");
+        return active ? stack[sp] : result;
     }
 
-    void Resize(size_t newlen)
+    // called once it has returned (or errored) and is suspended again: keeps just the return value, so its stack
+    // can be reused by the next coroutine right away rather than when this object dies
+    void Finish()
     {
-        if (newlen > stackcopymax)
-        {
-            if (stackcopy) DeallocSubBuf(stackcopy, stackcopymax);
-            stackcopy = AllocSubBuf(stackcopymax = newlen);
-        }
-        stackcopylen = newlen;
+        assert(!running && sp <= 0);
+        result = sp == 0 ? stack[0] : Value(0, V_NIL);
+        g_vm->FreeCoStack(stack, stacksize);
+        stack = nullptr;
+        sp = -1;
+        active = false;
     }
 
-    int Suspend(int top, Value *stack, int *&rip, CoRoutine *&curco)
+    void SwapStack(Value *&vmstack, int &vmstacksize, int &vmsp)
     {
-        assert(stackstart >= 0);
+        swap(vmstack, stack);
+        swap(vmstacksize, stacksize);
+        swap(vmsp, sp);
+    }
+
+    void Suspend(Value *&vmstack, int &vmstacksize, int &vmsp, int *&rip, CoRoutine *&curco)
+    {
+        assert(running);
 
         swap(rip, returnip);
 
@@ -452,70 +1348,60 @@ struct CoRoutine : RefObj
         curco = parent;
         parent = nullptr;
 
-        int newlen = top - stackstart;
-        Resize(newlen);
-        memcpy(stackcopy, stack + stackstart, stackcopylen * sizeof(Value));
-
-        int ss = stackstart;
-        stackstart = -1;
-        return ss;
+        SwapStack(vmstack, vmstacksize, vmsp);
+        running = false;
     }
 
-    int Resume(int top, Value *stack, int *&rip, CoRoutine *p)
+    void Resume(Value *&vmstack, int &vmstacksize, int &vmsp, int *&rip, CoRoutine *&curco)
     {
-        assert(stackstart < 0);
+        assert(!running);
 
         swap(rip, returnip);
 
         assert(!parent);
-        parent = p;
+        parent = curco;
+        curco = this;
 
-        stackstart = top;
-        // FIXME: assume that it fits, which is not guaranteed with recursive coros
-        memcpy(stack + top, stackcopy, stackcopylen * sizeof(Value));
-        return stackcopylen;
+        SwapStack(vmstack, vmstacksize, vmsp);
+        running = true;
     }
 
     void BackupParentVars(Value *vars)
     {
-        // stored here while coro is active
-        Resize(*varip);
-        for (int i = 1; i <= *varip; i++)
-        {
-            auto &var = vars[varip[i]];
-            // we don't INC, since parent var is still on the stack and will hold ref
-            stackcopy[i - 1] = var;
-        }
+        // we don't INC, since parent var is still on the stack and will hold ref
+        for (int i = 1; i <= *varip; i++) varbackup[i - 1] = varip[i] >= 0 ? vars[varip[i]] : Value();
+    }
+
+    void SwapVars(Value *vars)
+    {
+        for (int i = 1; i <= *varip; i++) if (varip[i] >= 0) swap(vars[varip[i]], varbackup[i - 1]);
     }
 
-    Value &GetVar(int ididx)
+    Value &GetVar(int ididx, int slot)
     {
-        if (stackstart >= 0)
+        if (running)
             g_vm->BuiltinError("cannot access locals of running coroutine");
 
-        // FIXME: we can probably make it work without this search, but for now no big deal
-        for (int i = 1; i <= *varip; i++)
-        {
-            if (varip[i] == ididx)
-            {
-                // -1 because of i's base, -1 because of retval on top of stack
-                return stackcopy[stackcopylen - *varip + i - 1 - 1];
-            }
-        }
         // this one should be really rare, since parser already only allows lexically contained vars for that function,
         // could happen when accessing var that's not in the callchain of yields
-        g_vm->BuiltinError("local variable being accessed is not part of coroutine state");
-        return *stackcopy;
+        if (slot < 0 || slot >= *varip || varip[slot + 1] != ididx)
+            g_vm->BuiltinError("local variable being accessed is not part of coroutine state");
+
+        return varbackup[slot];
     }
 
     void deleteself(bool deref)
     {
-        assert(stackstart < 0);
-        if (stackcopy)
+        assert(!running);
+        if (deref)
         {
-            if (deref) for (size_t i = 0; i < stackcopylen; i++) stackcopy[i].DEC();
-            DeallocSubBuf(stackcopy, stackcopymax);
+            for (int i = 0; i <= sp; i++) stack[i].DEC();
+            // once finished, the backup holds the parent's values, which it doesn't own
+            if (active) for (int i = 0; i < *varip; i++) varbackup[i].DEC();
+            else result.DEC();
         }
+        if (stack) g_vm->FreeCoStack(stack, stacksize);
+        DeallocSubBuf(varbackup, *varip);
         vmpool->dealloc(this, sizeof(CoRoutine));
     }
 
@@ -523,7 +1409,10 @@ struct CoRoutine : RefObj
     {
         if (refc < 0) return;
         refc = -refc;
-        if (stackstart < 0) for (size_t i = 0; i < stackcopylen; i++) stackcopy[i].Mark();
+        if (running) return;    // its stack is marked by the VM
+        for (int i = 0; i <= sp; i++) stack[i].Mark();
+        if (active) for (int i = 0; i < *varip; i++) varbackup[i].Mark();
+        else result.Mark();
     }
 };
 
@@ -546,6 +1435,12 @@ template<typename T> inline T ValueTo(const Value &v, float def = 0)
         }
         return t;
     }
+    else if (v.type == V_BUFFER)
+    {
+        T t;
+        for (int i = 0; i < T::NUM_ELEMENTS; i++) t.set(i, v.bval->len > i ? v.bval->atf(i) : def);
+        return t;
+    }
     else if (v.type == V_FLOAT)
     {
         return T(v.fval);
@@ -560,6 +1455,27 @@ template<typename T> inline T ValueTo(const Value &v, float def = 0)
     }
 }
 
+// for natives that take a list of points: either a vector of numeric vectors, or a flat buffer with stride numbers
+// per point
+inline int ValueElemCount(const Value &v, int stride)
+{
+    return v.type == V_BUFFER ? v.bval->len / stride : v.vval->len;
+}
+
+template<typename T> inline T ValueElemTo(const Value &v, int i, int stride, float def = 0)
+{
+    if (v.type != V_BUFFER) return ValueTo<T>(v.vval->at(i), def);
+    T t;
+    for (int j = 0; j < T::NUM_ELEMENTS; j++) t.set(j, j < stride ? v.bval->atf(i * stride + j) : def);
+    return t;
+}
+
+inline void CheckVectorOrBuffer(const Value &v, const char *name)
+{
+    if (v.type != V_VECTOR && v.type != V_BUFFER)
+        g_vm->BuiltinError(string(name) + ": argument must be a vector or a buffer, not: " + g_vm->ProperTypeName(v));
+}
+
 template<typename T> inline T ValueDecTo(const Value &v, float def = 0)
 {
     auto r = ValueTo<T>(v, def);